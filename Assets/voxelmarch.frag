@@ -1,8 +1,23 @@
 #version 330 core
 
+const int MAX_MIP_LEVELS = 9;
+
 uniform isamplerBuffer Model;
 uniform sampler1D Palette;
 uniform int BlockDim;  // must be at least 8!!
+uniform int MipOffset[MAX_MIP_LEVELS];  // texel offset of each mip level in a block
+uniform int MipLevels;
+uniform int BlockTexels;  // size of a block with all its mip levels
+uniform float LodScale;  // 0 disables level of detail
+uniform bool ShowSteps;
+uniform int AmbientOcclusion;  // one of the AO_ modes
+uniform isamplerBuffer SceneBVH;
+uniform isamplerBuffer SceneInstances;
+uniform int SceneNodeCount;  // 0 to use block 0 as the world
+uniform isamplerBuffer ChunkTable;  // slot of each chunk, -1 if not resident
+uniform ivec3 ChunkGridDim;  // 0 if not streaming
+uniform ivec3 ChunkWindowMin;  // first chunk covered by ChunkTable
+uniform int ChunkWindowDim;  // ChunkTable is a cube of chunks that wraps around
 uniform vec3 CamPos;
 uniform float PixelSize;
 
@@ -17,33 +32,60 @@ in vec3 iRayDir;  // not normalized!!
 
 out vec4 fColor;
 
+// EPSILON, MAX_RECURSE_DEPTH, DRAW_DIST and the voxel values below
+// must match voxloader.h
 const float EPSILON = 0.0001;
 const float BIG_EPSILON = 0.001;
 const int MAX_RECURSE_DEPTH = 4;
 const float DRAW_DIST = 256;
 const float AMBIENT_OCC_DIST = 1;  // diagonal
 const float AMBIENT_OCC_AMOUNT = 0.7;
+const int AMBIENT_OCC_FIELD_SAMPLES = 3;
+
+// ambient occlusion modes, must match the widget
+const int AO_FEELER_RAYS = 0;
+const int AO_DISTANCE_FIELD = 1;
+const int AO_NONE = 2;
 
+// voxel values
 const int INDEX_AIR = 0;
 const int INDEX_SKY = 127;
 const int INDEX_INSTANCE = 128;
 
-int raymarch(vec3 origin, vec3 dir, int medium,
+int stepCount = 0;
+// distance already travelled by the primary ray, so secondary rays pick
+// the same level of detail
+float lodBaseDist = 0;
+
+// coarsest mip level where a voxel (of the given size at full resolution)
+// still covers less than about a pixel
+int lodLevel(float voxelSize, float dist)
+{
+    float footprint = LodScale * PixelSize * (lodBaseDist + dist) / voxelSize;
+    if (footprint < 2)
+        return 0;
+    return min(int(log2(footprint)), MipLevels - 1);
+}
+
+int raymarch(vec3 origin, vec3 dir, int medium, int block, int level,
              float maxDist, inout float dist, out vec3 normal)
 {
     normal = -dir;
     bvec3 dirZero = lessThan(abs(dir), vec3(EPSILON));
-    float scale = 1;
-    int blockOffset = 0;
+    int dim = BlockDim >> level;
+    float scale = 1.0 / (1 << level);
+    int blockOffset = block * BlockTexels + MipOffset[level];
     int recurse = 0;
     // these are slow!
     float maxDistStack[MAX_RECURSE_DEPTH];
     int blockOffsetStack[MAX_RECURSE_DEPTH];  // store normal in lower 3 bits
+    int dimStack[MAX_RECURSE_DEPTH];
     while (true) {  // TODO iteration limit
+        stepCount++;
         vec3 p = (origin + dir * dist) * scale;
-        ivec3 voxelCoord = ivec3(floor(p)) & (BlockDim - 1);
-        int texelIndex = voxelCoord.x + voxelCoord.y * BlockDim
-                + (voxelCoord.z + blockOffset) * BlockDim * BlockDim;
+        ivec3 voxelCoord = ivec3(floor(p)) & (dim - 1);
+        int texelIndex = blockOffset + voxelCoord.x
+                + (voxelCoord.y + voxelCoord.z * dim) * dim;
         ivec2 c = texelFetch(Model, texelIndex).rg;
         if (c.r < INDEX_INSTANCE && c.r != medium) {
             return c.r;
@@ -57,12 +99,16 @@ int raymarch(vec3 origin, vec3 dir, int medium,
         if (c.r >= INDEX_INSTANCE) {
             maxDistStack[recurse] = maxDist;
             // pack normal into int, ugly but it works
-            blockOffsetStack[recurse] = blockOffset |
+            blockOffsetStack[recurse] = (blockOffset << 3) |
                     int(normalBits.x) | (int(normalBits.y) << 1) | (int(normalBits.z) << 2);
+            dimStack[recurse] = dim;
             recurse++;
-            scale *= BlockDim;
+            // distant blocks use a coarser mip
+            int childLevel = lodLevel(1.0 / (scale * BlockDim), dist);
+            dim = BlockDim >> childLevel;
+            scale *= dim;
             maxDist = nextDist;
-            blockOffset = BlockDim * (c.r - INDEX_INSTANCE);
+            blockOffset = (c.r - INDEX_INSTANCE) * BlockTexels + MipOffset[childLevel];
         } else {
             dist = nextDist;
             while (dist >= maxDist - EPSILON) {
@@ -76,31 +122,289 @@ int raymarch(vec3 origin, vec3 dir, int medium,
                 maxDist = maxDistStack[recurse];
                 blockOffset = blockOffsetStack[recurse];
                 normalBits = bvec3(blockOffset & 1, blockOffset & 2, blockOffset & 4);
-                blockOffset &= ~7;
-                scale /= BlockDim;
+                blockOffset >>= 3;
+                scale /= dim;
+                dim = dimStack[recurse];
             }
             normal = mix(vec3(0), -sign(dir), normalBits);
         }
     }
 }
 
+// returns entry and exit distance, entry > exit if missed
+vec2 intersectBox(vec3 origin, vec3 invDir, vec3 boxMin, vec3 boxMax,
+                  out vec3 normal)
+{
+    vec3 t0 = (boxMin - origin) * invDir;
+    vec3 t1 = (boxMax - origin) * invDir;
+    vec3 tMin = min(t0, t1);
+    vec3 tMax = max(t0, t1);
+    float near = max(tMin.x, max(tMin.y, tMin.z));
+    float far = min(tMax.x, min(tMax.y, tMax.z));
+    normal = mix(vec3(0), -sign(invDir), equal(vec3(near), tMin));
+    return vec2(near, far);
+}
+
+// walk the top level BVH and raymarch each instance it hits
+// the space between instances is always air
+int traceScene(vec3 origin, vec3 dir, float maxDist,
+               inout float dist, out vec3 normal)
+{
+    normal = -dir;
+    vec3 invDir = 1.0 / mix(dir, vec3(EPSILON), lessThan(abs(dir), vec3(EPSILON)));
+    int hitIndex = INDEX_AIR;
+    float hitDist = maxDist;
+    int node = 0;
+    while (node < SceneNodeCount) {
+        ivec4 nodeMin = texelFetch(SceneBVH, node * 2);
+        ivec4 nodeMax = texelFetch(SceneBVH, node * 2 + 1);
+        vec3 entryNormal;
+        vec2 t = intersectBox(origin, invDir, vec3(nodeMin.xyz), vec3(nodeMax.xyz),
+                              entryNormal);
+        if (t.x > t.y || t.y < dist || t.x > hitDist) {
+            node = nodeMax.w;  // skip subtree
+            continue;
+        }
+        node++;
+        if (nodeMin.w < 0)
+            continue;
+
+        ivec4 inst0 = texelFetch(SceneInstances, nodeMin.w * 4);
+        ivec4 inst1 = texelFetch(SceneInstances, nodeMin.w * 4 + 1);
+        ivec4 inst2 = texelFetch(SceneInstances, nodeMin.w * 4 + 2);
+        ivec4 inst3 = texelFetch(SceneInstances, nodeMin.w * 4 + 3);
+        // rotation is orthonormal, so distances are the same in local space
+        mat3 rotation = mat3(inst1.xyz, inst2.xyz, inst3.xyz);
+        mat3 invRotation = transpose(rotation);
+        vec3 localOrigin = invRotation * (origin - vec3(inst0.xyz));
+        vec3 localDir = invRotation * dir;
+        float startDist = max(t.x + EPSILON, dist);
+        float localDist = startDist;
+        vec3 localNormal;
+        int index = raymarch(localOrigin, localDir, INDEX_AIR,
+                             inst0.w, lodLevel(1.0, startDist),
+                             min(t.y, hitDist), localDist, localNormal);
+        if (index != INDEX_AIR && localDist < hitDist) {
+            hitIndex = index;
+            hitDist = localDist;
+            // raymarch doesn't know which face it entered through
+            normal = localDist == startDist && startDist > dist ?
+                        entryNormal : rotation * localNormal;
+        }
+    }
+    dist = hitDist;
+    return hitIndex;
+}
+
+// step through the streamed chunk grid and raymarch each resident chunk
+// slot of a chunk, -1 if it isn't resident or is outside the window
+int chunkSlot(ivec3 cell)
+{
+    if (any(lessThan(cell, ChunkWindowMin))
+            || any(greaterThanEqual(cell, ChunkWindowMin + ChunkWindowDim)))
+        return -1;
+    ivec3 wrapped = cell % ChunkWindowDim;  // cells are never negative
+    return texelFetch(ChunkTable,
+                      wrapped.x + (wrapped.y + wrapped.z * ChunkWindowDim) * ChunkWindowDim).r;
+}
+
+// chunks that aren't resident yet are unknown, and treated as air
+int traceChunks(vec3 origin, vec3 dir, float maxDist,
+                inout float dist, out vec3 normal)
+{
+    normal = -dir;
+    vec3 safeDir = mix(dir, vec3(EPSILON), lessThan(abs(dir), vec3(EPSILON)));
+    vec3 invDir = 1.0 / safeDir;
+    vec3 cellNormal;
+    // nothing outside the window is resident
+    ivec3 minCell = max(ChunkWindowMin, ivec3(0));
+    ivec3 maxCell = min(ChunkWindowMin + ChunkWindowDim, ChunkGridDim) - 1;
+    vec2 t = intersectBox(origin, invDir, vec3(minCell * BlockDim),
+                          vec3((maxCell + 1) * BlockDim), cellNormal);
+    float endDist = min(t.y, maxDist);
+    if (t.x > t.y || endDist < dist) {
+        dist = maxDist;
+        return INDEX_AIR;
+    }
+    if (t.x < dist)
+        cellNormal = -dir;  // started inside the grid
+    float cellDist = max(t.x, dist);
+
+    vec3 start = (origin + dir * (cellDist + EPSILON)) / BlockDim;
+    ivec3 cell = clamp(ivec3(floor(start)), minCell, maxCell);
+    ivec3 cellStep = ivec3(sign(safeDir));
+    vec3 tDelta = abs(invDir) * BlockDim;
+    vec3 tNext = (vec3(cell + ivec3(step(0, safeDir))) * BlockDim - origin) * invDir;
+    while (cellDist < endDist) {
+        stepCount++;
+        float cellExit = min(tNext.x, min(tNext.y, tNext.z));
+        int slot = chunkSlot(cell);
+        if (slot >= 0) {
+            float startDist = cellDist + EPSILON;
+            float localDist = startDist;
+            vec3 localNormal;
+            int index = raymarch(origin - vec3(cell * BlockDim), dir, INDEX_AIR,
+                                 slot, lodLevel(1.0, startDist),
+                                 min(cellExit, endDist), localDist, localNormal);
+            if (index != INDEX_AIR) {
+                dist = localDist;
+                normal = localDist == startDist ? cellNormal : localNormal;
+                return index;
+            }
+        }
+
+        if (tNext.x <= tNext.y && tNext.x <= tNext.z) {
+            cell.x += cellStep.x;
+            tNext.x += tDelta.x;
+            cellNormal = vec3(-cellStep.x, 0, 0);
+        } else if (tNext.y <= tNext.z) {
+            cell.y += cellStep.y;
+            tNext.y += tDelta.y;
+            cellNormal = vec3(0, -cellStep.y, 0);
+        } else {
+            cell.z += cellStep.z;
+            tNext.z += tDelta.z;
+            cellNormal = vec3(0, 0, -cellStep.z);
+        }
+        if (any(lessThan(cell, minCell)) || any(greaterThan(cell, maxCell)))
+            break;
+        cellDist = cellExit;
+    }
+    dist = maxDist;
+    return INDEX_AIR;
+}
+
+int trace(vec3 origin, vec3 dir, int medium,
+          float maxDist, inout float dist, out vec3 normal)
+{
+    if (ChunkGridDim.x > 0)
+        return traceChunks(origin, dir, maxDist, dist, normal);
+    if (SceneNodeCount > 0)
+        return traceScene(origin, dir, maxDist, dist, normal);
+    return raymarch(origin, dir, medium, 0, 0, maxDist, dist, normal);
+}
+
 float ambientOcclusion(vec3 origin, vec3 dir)
 {
     vec3 normal;
     float dist = BIG_EPSILON;
-    int index = raymarch(origin, dir, 0, AMBIENT_OCC_DIST, dist, normal);
+    int index = trace(origin, dir, 0, AMBIENT_OCC_DIST, dist, normal);
     if (index == INDEX_AIR || index == INDEX_SKY)
         return 0;
     float factor = 1 - dist / AMBIENT_OCC_DIST;
     return factor * factor;
 }
 
+// distance from a point in a block to the nearest voxel that isn't air,
+// read from the distance field without marching, going into nested blocks.
+// assumes the point is at the center of its voxel. a nested block's field
+// only sees its own voxels, so the distance is limited to its edge
+float blockDistance(vec3 p, int block)
+{
+    float scale = 1.0;
+    int blockOffset = block * BlockTexels;
+    float edgeDist = DRAW_DIST;
+    for (int recurse = 0; recurse <= MAX_RECURSE_DEPTH; recurse++) {
+        stepCount++;
+        vec3 local = p * scale;
+        ivec3 voxelCoord = ivec3(floor(local)) & (BlockDim - 1);
+        int texelIndex = blockOffset + voxelCoord.x
+                + (voxelCoord.y + voxelCoord.z * BlockDim) * BlockDim;
+        ivec2 c = texelFetch(Model, texelIndex).rg;
+        if (c.r < INDEX_INSTANCE) {
+            if (c.r != INDEX_AIR && c.r != INDEX_SKY)
+                return 0.0;
+            return min((c.g + 0.5) / scale, edgeDist);
+        }
+        vec3 f = fract(local);
+        vec3 toEdge = min(f, 1 - f) / scale;
+        edgeDist = min(edgeDist, min(toEdge.x, min(toEdge.y, toEdge.z)));
+        scale *= BlockDim;
+        blockOffset = (c.r - INDEX_INSTANCE) * BlockTexels;
+    }
+    return 0.0;  // too deep to tell
+}
+
+// same as blockDistance() for the nearest instance, skipping any BVH nodes
+// further than maxDist
+float sceneDistance(vec3 p, float maxDist)
+{
+    float minDist = maxDist;
+    int node = 0;
+    while (node < SceneNodeCount) {
+        stepCount++;
+        ivec4 nodeMin = texelFetch(SceneBVH, node * 2);
+        ivec4 nodeMax = texelFetch(SceneBVH, node * 2 + 1);
+        vec3 closest = clamp(p, vec3(nodeMin.xyz), vec3(nodeMax.xyz));
+        float boxDist = length(p - closest);
+        if (boxDist >= minDist) {
+            node = nodeMax.w;  // skip subtree
+            continue;
+        }
+        node++;
+        if (nodeMin.w < 0)
+            continue;
+
+        ivec4 inst0 = texelFetch(SceneInstances, nodeMin.w * 4);
+        ivec4 inst1 = texelFetch(SceneInstances, nodeMin.w * 4 + 1);
+        ivec4 inst2 = texelFetch(SceneInstances, nodeMin.w * 4 + 2);
+        ivec4 inst3 = texelFetch(SceneInstances, nodeMin.w * 4 + 3);
+        mat3 invRotation = transpose(mat3(inst1.xyz, inst2.xyz, inst3.xyz));
+        vec3 size = vec3(inst1.w, inst2.w, inst3.w);
+        vec3 local = clamp(invRotation * (closest - vec3(inst0.xyz)),
+                           vec3(BIG_EPSILON), size - BIG_EPSILON);
+        // anything that far from the closest point is at least this far from p
+        minDist = min(minDist, max(boxDist, blockDistance(local, inst0.w) - boxDist));
+    }
+    return minDist;
+}
+
+// chunks that aren't resident are air, like in traceChunks()
+float chunkDistance(vec3 p, float maxDist)
+{
+    ivec3 cell = ivec3(floor(p / BlockDim));
+    if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, ChunkGridDim)))
+        return maxDist;
+    int slot = chunkSlot(cell);
+    if (slot < 0)
+        return maxDist;
+    // chunk edges aren't clamped, that would darken every seam
+    return min(blockDistance(p - vec3(cell * BlockDim), slot), maxDist);
+}
+
+float solidDistance(vec3 p, float maxDist)
+{
+    if (ChunkGridDim.x > 0)
+        return chunkDistance(p, maxDist);
+    if (SceneNodeCount > 0)
+        return sceneDistance(p, maxDist);
+    return min(blockDistance(p, 0), maxDist);
+}
+
+// sample the distance field at the voxels stacked along the normal, the
+// first one is skipped since it always touches the surface. a sample
+// closer to a solid voxel than to the surface is occluded, near samples
+// count the most. a fixed number of texel fetches instead of four rays
+float distanceFieldOcclusion(vec3 pos, vec3 normal)
+{
+    float occlusion = 0, weight = 1, totalWeight = 0;
+    for (int i = 1; i <= AMBIENT_OCC_FIELD_SAMPLES; i++) {
+        float height = (i + 0.5) * AMBIENT_OCC_DIST;
+        float dist = solidDistance(pos + normal * height, height);
+        occlusion += weight * (1 - dist / height);
+        totalWeight += weight;
+        weight *= 0.5;
+    }
+    occlusion /= totalWeight;
+    return occlusion * occlusion;
+}
+
 vec3 subPixelRaymarch(vec3 origin, vec3 dir)
 {
     float dist = 0;
     vec3 normal;
-    int index = raymarch(origin, dir, INDEX_AIR,
-                         DRAW_DIST, dist, normal);
+    int index = trace(origin, dir, INDEX_AIR,
+                      DRAW_DIST, dist, normal);
     if (index == INDEX_AIR)
         index = INDEX_SKY;
     return texelFetch(Palette, index, 0).rgb;
@@ -111,8 +415,8 @@ void main()
     vec3 normRayDir = normalize(iRayDir);
     float dist = 0;
     vec3 normal;
-    int index = raymarch(CamPos, normRayDir, INDEX_AIR,
-                         DRAW_DIST, dist, normal);
+    int index = trace(CamPos, normRayDir, INDEX_AIR,
+                      DRAW_DIST, dist, normal);
     if (index == INDEX_AIR)
         index = INDEX_SKY;
     vec3 c = texelFetch(Palette, index, 0).rgb;
@@ -120,25 +424,30 @@ void main()
     if (index != INDEX_SKY) {
         vec3 light = AmbientColor;
         vec3 pos = CamPos + normRayDir * dist;
+        lodBaseDist = dist;
 
-        // TODO requires normal to be axis aligned
-        vec3 ambOccAxis1 = mix(vec3(0), vec3(1), equal(normal, vec3(0)));
-        vec3 ambOccAxis2 = mix(ambOccAxis1, vec3(-1), notEqual(normal.zxy, vec3(0)));
-        // cast short feeler rays in 4 directions
-        // rays move diagonally on all axes, and away from surface
-        // TODO cast horizontal to surface instead?
-        c *= 1 - AMBIENT_OCC_AMOUNT * max(max(max(
-            ambientOcclusion(pos, (normal + ambOccAxis1) / sqrt(3)),
-            ambientOcclusion(pos, (normal - ambOccAxis1) / sqrt(3))),
-            ambientOcclusion(pos, (normal + ambOccAxis2) / sqrt(3))),
-            ambientOcclusion(pos, (normal - ambOccAxis2) / sqrt(3)));
+        if (AmbientOcclusion == AO_FEELER_RAYS) {
+            // TODO requires normal to be axis aligned
+            vec3 ambOccAxis1 = mix(vec3(0), vec3(1), equal(normal, vec3(0)));
+            vec3 ambOccAxis2 = mix(ambOccAxis1, vec3(-1), notEqual(normal.zxy, vec3(0)));
+            // cast short feeler rays in 4 directions
+            // rays move diagonally on all axes, and away from surface
+            // TODO cast horizontal to surface instead?
+            c *= 1 - AMBIENT_OCC_AMOUNT * max(max(max(
+                ambientOcclusion(pos, (normal + ambOccAxis1) / sqrt(3)),
+                ambientOcclusion(pos, (normal - ambOccAxis1) / sqrt(3))),
+                ambientOcclusion(pos, (normal + ambOccAxis2) / sqrt(3))),
+                ambientOcclusion(pos, (normal - ambOccAxis2) / sqrt(3)));
+        } else if (AmbientOcclusion == AO_DISTANCE_FIELD) {
+            c *= 1 - AMBIENT_OCC_AMOUNT * distanceFieldOcclusion(pos, normal);
+        }
 
         float sunDot = -dot(normal, SunDir);
         if (sunDot > 0) {
             float shadowDist = BIG_EPSILON;
             vec3 shadowNorm;
-            int shadowIndex = raymarch(pos, -SunDir, INDEX_AIR,
-                                       DRAW_DIST, shadowDist, shadowNorm);
+            int shadowIndex = trace(pos, -SunDir, INDEX_AIR,
+                                    DRAW_DIST, shadowDist, shadowNorm);
             if (shadowIndex == INDEX_AIR || shadowIndex == INDEX_SKY)
                 light += SunColor * sunDot;
         }
@@ -150,8 +459,8 @@ void main()
         if (pointDot > 0 && pointDist < PointLightRange) {
             float shadowDist = BIG_EPSILON;
             vec3 shadowNorm;
-            int shadowIndex = raymarch(pos, pointDir, INDEX_AIR,
-                                       pointDist, shadowDist, shadowNorm);
+            int shadowIndex = trace(pos, pointDir, INDEX_AIR,
+                                    pointDist, shadowDist, shadowNorm);
             if (shadowIndex == INDEX_AIR)
                 light += PointLightColor * pointDot / (pointDist * pointDist);
         }
@@ -163,4 +472,8 @@ void main()
     // https://www.iquilezles.org/www/articles/outdoorslighting/outdoorslighting.htm
     c = pow(c, vec3(1.0 / 2.2));
     fColor = vec4(c, 1.0);
+    if (ShowSteps) {
+        // total steps for all rays in this pixel, blue is few and red is many
+        fColor = vec4(mix(vec3(0, 0, 1), vec3(1, 0, 0), min(stepCount / 512.0, 1.0)), 1);
+    }
 }
@@ -0,0 +1,29 @@
+# Benchmarks for loading, preprocessing and CPU queries, without OpenGL
+# qmake bench.pro && make && ./voxbench --help
+
+QT = core
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = voxbench
+
+INCLUDEPATH += .. ../Libraries
+
+SOURCES += \
+    main.cpp \
+    ../scenebvh.cpp \
+    ../stats.cpp \
+    ../voxloader.cpp \
+    ../voxpreprocess.cpp \
+    ../voxquery.cpp
+
+HEADERS += \
+    ../scenebvh.h \
+    ../stats.h \
+    ../util.h \
+    ../voxloader.h \
+    ../voxpreprocess.h \
+    ../voxquery.h
+
+RESOURCES += \
+    ../Assets/resource.qrc
@@ -0,0 +1,239 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QFile>
+#include <QTextStream>
+#include <QDebug>
+#include <QLoggingCategory>
+#include <random>
+#include <functional>
+#include "stats.h"
+#include "voxloader.h"
+#include "voxpreprocess.h"
+#include "voxquery.h"
+
+// the brute force distance field takes far too long on big mostly empty blocks
+static const int DEFAULT_MAX_PREPROCESS_DIM = 64;
+
+static const char *ASSETS[] = {
+    ":/minecraft.vox", ":/blocktest.xraw", ":/chr_knight.xraw", ":/monu1.xraw"
+};
+static const int SYNTHETIC_SIZES[] = {8, 16, 32, 64};
+static const float SYNTHETIC_DENSITY = 0.5f;
+// palette indices above this are sky and instances
+static const int MAX_MATERIAL = 126;
+static const int QUERY_BATCH = 10000;
+
+struct BenchOptions
+{
+    int repeat;
+    QString filter;
+    int maxPreprocessDim;
+};
+
+class Bench
+{
+public:
+    Bench(const BenchOptions &options, QTextStream &out)
+        : options(options), out(out) { }
+
+    // time fn over several runs and write one JSON line,
+    // items is the amount of work per run for a throughput number.
+    // setup runs untimed before every run
+    void run(QString name, QString variant, double items, std::function<void()> fn,
+             std::function<void()> setup = nullptr)
+    {
+        QString fullName = name + "/" + variant;
+        if (!fullName.contains(options.filter))
+            return;
+        double total = 0, best = 0;
+        for (int i = 0; i < options.repeat; i++) {
+            if (setup)
+                setup();
+            QElapsedTimer timer;
+            timer.start();
+            fn();
+            double ms = timer.nsecsElapsed() / 1e6;
+            total += ms;
+            if (i == 0 || ms < best)
+                best = ms;
+        }
+        QJsonObject result;
+        result["benchmark"] = name;
+        result["variant"] = variant;
+        result["runs"] = options.repeat;
+        result["mean_ms"] = total / options.repeat;
+        result["min_ms"] = best;
+        if (items > 0)
+            result["items_per_sec"] = items / (best / 1000);
+        write(result);
+    }
+
+    void skip(QString name, QString variant, QString reason)
+    {
+        if (!(name + "/" + variant).contains(options.filter))
+            return;
+        QJsonObject result;
+        result["benchmark"] = name;
+        result["variant"] = variant;
+        result["skipped"] = reason;
+        write(result);
+    }
+
+    const BenchOptions &options;
+
+private:
+    void write(const QJsonObject &result)
+    {
+        out << QJsonDocument(result).toJson(QJsonDocument::Compact) << "\n";
+        out.flush();
+    }
+
+    QTextStream &out;
+};
+
+static void benchWorld(Bench &bench, QString variant, VoxPack &pack)
+{
+    int maxDim = 0;
+    for (auto &model : pack.models)
+        maxDim = std::max(maxDim, std::max(model.xDim, std::max(model.yDim, model.zDim)));
+    if (maxDim > bench.options.maxPreprocessDim) {
+        bench.skip("preprocess", variant, "block too big, see --max-preprocess-dim");
+        return;
+    }
+
+    VoxWorld world;
+    double voxels = 0;
+    for (auto &model : pack.models) {
+        if (model.block >= 0)
+            voxels += (double)model.xDim * model.yDim * model.zDim;
+    }
+    // preprocessing is in place, every run needs the blocks as loaded
+    std::vector<unsigned char> blocks = pack.blockData;
+    bench.run("preprocess", variant, voxels, [&] {
+        BuildVoxWorld(pack, world);
+    }, [&] {
+        pack.blockData = blocks;
+        // so the last run's blocks aren't freed in the timed part
+        std::vector<unsigned char>().swap(world.udfVoxData);
+    });
+
+    // IsFilled is the inner loop of the distance field, time one shell
+    // around every voxel of the first block
+    int dim = world.blockSize;
+    bench.run("is_filled", variant, (double)dim * dim * dim, [&] {
+        volatile int filled = 0;
+        for (int z = 0; z < dim; z++)
+            for (int y = 0; y < dim; y++)
+                for (int x = 0; x < dim; x++)
+                    filled += IsFilled(world.udfVoxData.data(), dim, 0, x, y, z, 1,
+                                       world.udfVoxData[UDF_INDEX(x, y, z, dim)]);
+    });
+
+    // random rays and spheres within the first block
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(0, dim);
+    std::normal_distribution<float> direction;
+    std::vector<RayQuery> rays(QUERY_BATCH);
+    std::vector<SphereQuery> spheres(QUERY_BATCH);
+    for (int i = 0; i < QUERY_BATCH; i++) {
+        glm::vec3 origin(position(rng), position(rng), position(rng));
+        glm::vec3 dir(direction(rng), direction(rng), direction(rng));
+        rays[i] = RayQuery{origin, glm::normalize(dir), 256};
+        spheres[i] = SphereQuery{origin, 0.25f};
+    }
+    VoxQuery query(world);
+    bench.run("cast_rays", variant, QUERY_BATCH, [&] {
+        query.castRays(rays);
+    });
+    bench.run("overlap_spheres", variant, QUERY_BATCH, [&] {
+        query.overlapSpheres(spheres);
+    });
+}
+
+static void benchAsset(Bench &bench, QString filename)
+{
+    QString variant = filename.mid(2);  // strip ":/"
+    bench.run("load", variant, 0, [&] {
+        VoxLoader voxload(filename);
+        voxload.load();
+    });
+
+    VoxLoader voxload(filename);
+    if (!voxload.load()) {
+        bench.skip("preprocess", variant, "load failed");
+        return;
+    }
+    benchWorld(bench, variant, voxload.pack);
+}
+
+static void benchSynthetic(Bench &bench, int size)
+{
+    VoxPack pack;
+    pack.name = QString("synthetic_%1").arg(size);
+    pack.models.emplace_back(size, size, size);
+    pack.models[0].block = 0;
+    pack.orderedModels.push_back(0);
+    pack.allocateBlocks(1, 8);
+    std::mt19937 rng(size);
+    std::bernoulli_distribution solid(SYNTHETIC_DENSITY);
+    std::uniform_int_distribution<int> material(1, MAX_MATERIAL);
+    for (int z = 0; z < size; z++)
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+                pack.voxel(pack.models[0], x, y, z) = solid(rng) ? material(rng) : 0;
+    benchWorld(bench, pack.name, pack);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(
+                "Benchmarks the voxel loader, preprocessing and CPU queries.\n"
+                "Writes one JSON object per line.");
+    parser.addHelpOption();
+    QCommandLineOption repeatOption("repeat", "Runs of each benchmark.", "n", "5");
+    QCommandLineOption filterOption("filter", "Only run benchmark/variant names containing text.",
+                                    "text");
+    QCommandLineOption maxDimOption("max-preprocess-dim",
+                                    "Skip preprocessing models bigger than this.", "size",
+                                    QString::number(DEFAULT_MAX_PREPROCESS_DIM));
+    QCommandLineOption outputOption("output", "Write results to a file instead of stdout.",
+                                    "file");
+    QCommandLineOption statsOption("stats", "Write load time and memory stats to a JSON file.",
+                                   "file");
+    parser.addOptions({repeatOption, filterOption, maxDimOption, outputOption, statsOption});
+    parser.process(app);
+
+    // loader debug output would drown the results
+    QLoggingCategory::setFilterRules("*.debug=false");
+
+    BenchOptions options;
+    options.repeat = std::max(1, parser.value(repeatOption).toInt());
+    options.filter = parser.value(filterOption);
+    options.maxPreprocessDim = parser.value(maxDimOption).toInt();
+
+    QFile outFile;
+    if (parser.isSet(outputOption)) {
+        outFile.setFileName(parser.value(outputOption));
+        if (!outFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            qCritical() << "Can't write" << outFile.fileName();
+            return EXIT_FAILURE;
+        }
+    } else {
+        outFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    }
+    QTextStream out(&outFile);
+
+    Bench bench(options, out);
+    for (auto filename : ASSETS)
+        benchAsset(bench, filename);
+    for (int size : SYNTHETIC_SIZES)
+        benchSynthetic(bench, size);
+    if (parser.isSet(statsOption) && !StatsRegistry::instance().dump(parser.value(statsOption)))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
@@ -1,4 +1,5 @@
 #include "mainwindow.h"
+#include "stats.h"
 
 #include <QApplication>
 #include <QSurfaceFormat>
@@ -17,7 +18,15 @@ int main(int argc, char *argv[])
 #endif
     QSurfaceFormat::setDefaultFormat(format);
 
-    MainWindow w;
-    w.show();
-    return a.exec();
+    int result;
+    {
+        MainWindow w;
+        w.show();
+        result = a.exec();
+    }
+    // after the window is gone, so anything still held was never released
+    QString statsFile = qEnvironmentVariable("VOXSTATS");
+    if (!statsFile.isEmpty())
+        StatsRegistry::instance().dump(statsFile);
+    return result;
 }
@@ -1,9 +1,14 @@
 #include "mainwindow.h"
+#include <QCoreApplication>
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent),
       glWidget(this)
 {
+    // a directory of chunk files can be given to stream a large world
+    QStringList args = QCoreApplication::arguments();
+    if (args.size() > 1)
+        glWidget.setWorldDir(args[1]);
     resize(640, 480);
     setCentralWidget(&glWidget);
 }
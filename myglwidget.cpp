@@ -1,15 +1,31 @@
 #include "myglwidget.h"
 #include <QOpenGLContext>
 #include <QFile>
+#include <QJsonDocument>
 #include "opengllog.h"
+#include "scenebvh.h"
+#include "stats.h"
+#include "voxpreprocess.h"
 #include <glm/ext/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <cstdlib>
 
 const GLsizei NUM_FRAME_VERTS = 6;
 const GLuint VERT_POSITION_LOC = 0;
 const GLuint VERT_UV_LOC = 1;
 
 const float FLY_SPEED = 0.05f;
+// collision radius, less than the distance to the near plane
+const float CAM_RADIUS = 0.25f;
+
+// GPU memory for streamed chunks, this bounds memory for any world size
+const GLsizeiptr STREAM_BUDGET = 256 << 20;
+
+const char * const AO_MODE_NAMES[AO_NUM_MODES] {
+    "feeler rays", "distance field", "none"
+};
+// averaged for each mode when comparing ambient occlusion
+const int COMPARE_FRAMES = 10;
 
 const glm::vec3 CAM_FORWARD(1, 0, 0);
 const glm::vec3 CAM_RIGHT(0, -1, 0);
@@ -26,12 +42,33 @@ MyGLWidget::MyGLWidget(QWidget *parent)
     setFocusPolicy(Qt::FocusPolicy::ClickFocus);
 }
 
+void MyGLWidget::setWorldDir(QString dir)
+{
+    worldDir = dir;
+}
+
 MyGLWidget::~MyGLWidget()
 {
     makeCurrent();
 
     logger.stopLogging();
-    // etc
+    if (isValid()) {
+        glDeleteQueries(1, &timerQuery);
+        glDeleteQueries(1, &compareQuery);
+        glDeleteProgram(program);
+        glDeleteVertexArrays(1, &frameVAO);
+        GLuint buffers[] {framePosBuffer, frameUVBuffer, modelBuffer, sceneBVHBuffer,
+                          sceneInstanceBuffer, chunkTableBuffer};
+        glDeleteBuffers(sizeof(buffers) / sizeof(buffers[0]), buffers);
+        GLuint textures[] {modelTexture, paletteTexture, sceneBVHTexture,
+                           sceneInstanceTexture, chunkTableTexture};
+        glDeleteTextures(sizeof(textures) / sizeof(textures[0]), textures);
+    }
+
+    auto &stats = StatsRegistry::instance();
+    for (auto name : {"frame buffers", "model buffer", "palette texture",
+                      "scene BVH buffer", "scene instance buffer", "chunk table buffer"})
+        stats.setBytes("gpu", name, 0);
 
     doneCurrent();
 }
@@ -99,14 +136,32 @@ void MyGLWidget::initializeGL()
     glVertexAttribPointer(VERT_UV_LOC, 2, GL_FLOAT,
                           GL_FALSE, 0, (void *)0);
     glEnableVertexAttribArray(VERT_UV_LOC);
+    StatsRegistry::instance().setBytes("gpu", "frame buffers", sizeof(vertices) * 2);
 
-    {
+    if (!worldDir.isEmpty()) {
+        streamer.reset(new WorldStreamer(worldDir, DRAW_DIST));
+        if (!streamer->open()) {
+            qWarning() << "Error opening world" << worldDir;
+            exit(EXIT_FAILURE);
+        }
+        initStreaming();
+    } else {
         VoxLoader voxload(":/minecraft.vox");
         if (!voxload.load()) {
             qWarning() << "Error loading file";
             exit(EXIT_FAILURE);
         }
-        uploadVoxelData(voxload.pack);
+        GLint maxTexels;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        if (voxload.pack.blockData.size() / 2 > maxTexels) {
+            qWarning() << "Models are too big for a texture buffer";
+            exit(EXIT_FAILURE);
+        }
+        // kept on the CPU for collision queries
+        world.reset(new VoxWorld);
+        BuildVoxWorld(voxload.pack, *world);
+        uploadVoxelData(*world, voxload.pack.palette);
+        query.reset(new VoxQuery(*world));
     }
 
     // default uniform values
@@ -123,6 +178,7 @@ void MyGLWidget::initializeGL()
 
     // used to measure frame time
     glGenQueries(1, &timerQuery);
+    glGenQueries(1, &compareQuery);
 }
 
 void MyGLWidget::getProgramUniforms(GLuint program)
@@ -130,6 +186,19 @@ void MyGLWidget::getProgramUniforms(GLuint program)
     modelLoc = glGetUniformLocation(program, "Model");
     paletteLoc = glGetUniformLocation(program, "Palette");
     blockDimLoc = glGetUniformLocation(program, "BlockDim");
+    mipOffsetLoc = glGetUniformLocation(program, "MipOffset");
+    mipLevelsLoc = glGetUniformLocation(program, "MipLevels");
+    blockTexelsLoc = glGetUniformLocation(program, "BlockTexels");
+    lodScaleLoc = glGetUniformLocation(program, "LodScale");
+    showStepsLoc = glGetUniformLocation(program, "ShowSteps");
+    ambientOcclusionLoc = glGetUniformLocation(program, "AmbientOcclusion");
+    chunkTableLoc = glGetUniformLocation(program, "ChunkTable");
+    chunkGridDimLoc = glGetUniformLocation(program, "ChunkGridDim");
+    chunkWindowMinLoc = glGetUniformLocation(program, "ChunkWindowMin");
+    chunkWindowDimLoc = glGetUniformLocation(program, "ChunkWindowDim");
+    sceneBVHLoc = glGetUniformLocation(program, "SceneBVH");
+    sceneInstancesLoc = glGetUniformLocation(program, "SceneInstances");
+    sceneNodeCountLoc = glGetUniformLocation(program, "SceneNodeCount");
     camPosLoc = glGetUniformLocation(program, "CamPos");
     camDirLoc = glGetUniformLocation(program, "CamDir");
     camULoc = glGetUniformLocation(program, "CamU");
@@ -143,93 +212,187 @@ void MyGLWidget::getProgramUniforms(GLuint program)
     pointLightRangeLoc = glGetUniformLocation(program, "PointLightRange");
 }
 
-#define UDF_INDEX(x, y, z, dim) (((x) + (dim)*(y) + (dim)*(dim)*(z)) * 2)
+void MyGLWidget::uploadVoxelData(const VoxWorld &world, const float *palette)
+{
+    ScopedTimer timer("upload");
+    setBlockLayout(world.blockSize);
+    createModelBuffer(world.udfVoxData.size(), world.udfVoxData.data(), GL_STATIC_DRAW);
+
+    // top level BVH over instance bounds, two texels per node:
+    // (min, instance) (max, skip)
+    std::vector<GLint> bvhData;
+    for (auto &node : world.bvh) {
+        bvhData.insert(bvhData.end(), {node.boundsMin.x, node.boundsMin.y,
+                                       node.boundsMin.z, node.instance});
+        bvhData.insert(bvhData.end(), {node.boundsMax.x, node.boundsMax.y,
+                                       node.boundsMax.z, node.skip});
+    }
+    // four texels per instance: (origin, block) then each rotation column
+    // with the model size on that local axis
+    std::vector<GLint> instanceData;
+    for (auto &instance : world.instances) {
+        const glm::mat3 &r = instance.rotation;
+        instanceData.insert(instanceData.end(), {
+            instance.origin.x, instance.origin.y, instance.origin.z, instance.block,
+            (GLint)r[0].x, (GLint)r[0].y, (GLint)r[0].z, instance.size.x,
+            (GLint)r[1].x, (GLint)r[1].y, (GLint)r[1].z, instance.size.y,
+            (GLint)r[2].x, (GLint)r[2].y, (GLint)r[2].z, instance.size.z});
+    }
+    if (!world.bvh.empty()) {
+        qDebug() << "BVH nodes:" << world.bvh.size();
+        glGenBuffers(1, &sceneBVHBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, sceneBVHBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, bvhData.size() * sizeof(GLint),
+                     bvhData.data(), GL_STATIC_DRAW);
+        glGenTextures(1, &sceneBVHTexture);
+        glActiveTexture(GL_TEXTURE0 + 2);
+        glBindTexture(GL_TEXTURE_BUFFER, sceneBVHTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, sceneBVHBuffer);
+
+        glGenBuffers(1, &sceneInstanceBuffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, sceneInstanceBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, instanceData.size() * sizeof(GLint),
+                     instanceData.data(), GL_STATIC_DRAW);
+        glGenTextures(1, &sceneInstanceTexture);
+        glActiveTexture(GL_TEXTURE0 + 3);
+        glBindTexture(GL_TEXTURE_BUFFER, sceneInstanceTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32I, sceneInstanceBuffer);
+
+        auto &stats = StatsRegistry::instance();
+        stats.setBytes("gpu", "scene BVH buffer", bvhData.size() * sizeof(GLint));
+        stats.setBytes("gpu", "scene instance buffer", instanceData.size() * sizeof(GLint));
+    }
+
+    uploadPalette(palette);
 
-bool IsFilled(unsigned char *udfVoxData, int dim, int offset,
-              int cx, int cy, int cz, int size, int value)
+    glUniform1i(sceneBVHLoc, 2);  // TEXTURE2
+    glUniform1i(sceneInstancesLoc, 3);  // TEXTURE3
+    // no nodes means block 0 is the world, repeating forever
+    glUniform1i(sceneNodeCountLoc, world.bvh.size());
+}
+
+void MyGLWidget::initStreaming()
 {
-    int minX = cx - size, minY = cy - size, minZ = cz - size;
-    int maxX = cx + size, maxY = cy + size, maxZ = cz + size;
-    for (int z = minZ; z <= maxZ; z++) {
-        for (int y = minY; y <= maxY; y++) {
-            for (int x = minX; x <= maxX; x++) {
-                if (glm::length(glm::vec3( glm::max(glm::abs(x - cx) - 1, 0),
-                                           glm::max(glm::abs(y - cy) - 1, 0),
-                                           glm::max(glm::abs(z - cz) - 1, 0) ))
-                        >= size + 0.01)
-                    continue;
-                int index = UDF_INDEX((x + dim) % dim, (y + dim) % dim,
-                                      (z + dim) % dim, dim) + offset;
-                if (udfVoxData[index] != value)
-                    return false;
-            }
-        }
+    int blockSize = streamer->blockSize;
+    int blockTexels = setBlockLayout(blockSize);
+    // every slot is one block, as many as fit in the budget and can be
+    // addressed by the shader
+    GLint maxTexels;
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+    GLsizeiptr blockBytes = (GLsizeiptr)blockTexels * 2;
+    int maxSlots = std::min(maxTexels, MAX_MODEL_TEXELS) / blockTexels;
+    int numSlots = (int)std::min(STREAM_BUDGET / blockBytes, (GLsizeiptr)maxSlots);
+    if (numSlots < 1) {
+        qWarning() << "Chunks are too big for a texture buffer";
+        exit(EXIT_FAILURE);
     }
-    return true;
+    streamer->start(numSlots);
+    // filled in as chunks are loaded
+    createModelBuffer(blockBytes * numSlots, nullptr, GL_DYNAMIC_DRAW);
+    qDebug() << "Stream slots:" << numSlots
+             << "using" << (blockBytes * numSlots / 1024) << "KB";
+
+    // indirection table for the window around the camera, slot of each
+    // chunk or -1 if it isn't resident
+    const std::vector<int> &table = streamer->windowSlots;
+    glGenBuffers(1, &chunkTableBuffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, chunkTableBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, table.size() * sizeof(GLint),
+                 table.data(), GL_DYNAMIC_DRAW);
+    glGenTextures(1, &chunkTableTexture);
+    glActiveTexture(GL_TEXTURE0 + 4);
+    glBindTexture(GL_TEXTURE_BUFFER, chunkTableTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32I, chunkTableBuffer);
+    StatsRegistry::instance().setBytes("gpu", "chunk table buffer",
+                                       table.size() * sizeof(GLint));
+
+    uploadPalette(streamer->palette);
+
+    glm::ivec3 gridDim = streamer->gridDim;
+    glUniform1i(chunkTableLoc, 4);  // TEXTURE4
+    glUniform3i(chunkGridDimLoc, gridDim.x, gridDim.y, gridDim.z);
+    glUniform1i(chunkWindowDimLoc, streamer->windowDim);
 }
 
-void MyGLWidget::uploadVoxelData(const VoxPack &pack)
+void MyGLWidget::updateStreaming()
 {
-    // assume cubic blocks all of equal size
-    int blockSize = pack.orderedModels[0]->xDim;
-    int numBlocks = pack.orderedModels.size();
-
-    int udfSize = blockSize * blockSize * blockSize * numBlocks * 2;
-    // distance field stores the minimum distance from the *edge* of this voxel
-    // to the *edge* of a voxel of a different value
-    unsigned char *udfVoxData = new unsigned char[udfSize];
-
-    for (int blockI = 0; blockI < numBlocks; blockI++) {
-        int udfOffset = UDF_INDEX(0, 0, blockI * blockSize, blockSize);
-        VoxModel &model = *pack.orderedModels[blockI];
-        int numVoxels = model.xDim * model.yDim * model.zDim;
-        for (int i = 0; i < numVoxels; i++) {
-            udfVoxData[udfOffset + i * 2] = model.data[i];
-        }
+    streamer->update(glm::vec3(camPos));
+    if (streamer->windowMoved) {
+        streamer->windowMoved = false;
+        const std::vector<int> &table = streamer->windowSlots;
+        glBindBuffer(GL_TEXTURE_BUFFER, chunkTableBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, table.size() * sizeof(GLint), table.data());
+        glm::ivec3 windowMin = streamer->windowMin;
+        glUniform3i(chunkWindowMinLoc, windowMin.x, windowMin.y, windowMin.z);
+    }
 
-        // very slow brute force!!
-        for (int z = 0; z < blockSize; z++) {
-            for (int y = 0; y < blockSize; y++) {
-                for (int x = 0; x < blockSize; x++) {
-                    int index = UDF_INDEX(x, y, z, blockSize) + udfOffset;
-                    int value = udfVoxData[index];
-                    int size;
-                    for (size = 1; size < blockSize; size++) {
-                        if (!IsFilled(udfVoxData, blockSize, udfOffset,
-                                      x, y, z, size, value)) {
-                            break;
-                        }
-                    }
-                    size--;
-                    udfVoxData[index + 1] = size;
-                }
+    GLsizeiptr blockBytes = (GLsizeiptr)BlockMipOffset(
+                streamer->blockSize, BlockMipLevels(streamer->blockSize)) * 2;
+    for (auto &chunk : streamer->takeLoaded()) {
+        ScopedTimer timer("chunk upload");
+        long long evictedKey;
+        int slot = streamer->allocateSlot(chunk.key, &evictedKey);
+        glBindBuffer(GL_TEXTURE_BUFFER, modelBuffer);
+        glBufferSubData(GL_TEXTURE_BUFFER, (GLintptr)slot * blockBytes, blockBytes,
+                        chunk.udfVoxData.data());
+
+        // allocateSlot() already updated the window, copy the changed cells
+        glBindBuffer(GL_TEXTURE_BUFFER, chunkTableBuffer);
+        for (long long key : {evictedKey, chunk.key}) {
+            if (key < 0)
+                continue;
+            int index = streamer->windowIndex(streamer->chunkCoord(key));
+            if (index >= 0) {
+                glBufferSubData(GL_TEXTURE_BUFFER, index * sizeof(GLint), sizeof(GLint),
+                                &streamer->windowSlots[index]);
             }
         }
     }
+}
+
+int MyGLWidget::setBlockLayout(int blockSize)
+{
+    int mipLevels = BlockMipLevels(blockSize);
+    GLint mipOffsets[MAX_MIP_LEVELS];
+    for (int level = 0; level < mipLevels; level++)
+        mipOffsets[level] = BlockMipOffset(blockSize, level);
+    int blockTexels = BlockMipOffset(blockSize, mipLevels);
+
+    glUniform1i(blockDimLoc, blockSize);  // cube
+    glUniform1iv(mipOffsetLoc, mipLevels, mipOffsets);
+    glUniform1i(mipLevelsLoc, mipLevels);
+    glUniform1i(blockTexelsLoc, blockTexels);
+    return blockTexels;
+}
 
+void MyGLWidget::createModelBuffer(GLsizeiptr size, const void *data, GLenum usage)
+{
     glGenBuffers(1, &modelBuffer);
     glBindBuffer(GL_TEXTURE_BUFFER, modelBuffer);
-    glBufferData(GL_TEXTURE_BUFFER, udfSize, udfVoxData, GL_STATIC_DRAW);
+    glBufferData(GL_TEXTURE_BUFFER, size, data, usage);
     glGenTextures(1, &modelTexture);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_1D, modelTexture);
+    glBindTexture(GL_TEXTURE_BUFFER, modelTexture);
     glTexBuffer(GL_TEXTURE_BUFFER, GL_RG8UI, modelBuffer);
+    glUniform1i(modelLoc, 0);  // TEXTURE0
+    StatsRegistry::instance().setBytes("gpu", "model buffer", size);
+}
 
+void MyGLWidget::uploadPalette(const float *palette)
+{
     glGenTextures(1, &paletteTexture);
     glActiveTexture(GL_TEXTURE0 + 1);
     glBindTexture(GL_TEXTURE_1D, paletteTexture);
     glTexImage1D(GL_TEXTURE_1D, 0, GL_RGBA, PALETTE_ENTRIES, 0,
-                 GL_RGBA, GL_FLOAT, pack.palette);
+                 GL_RGBA, GL_FLOAT, palette);
     glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-
-    glUniform1i(modelLoc, 0);  // TEXTURE0
     glUniform1i(paletteLoc, 1);  // TEXTURE1
-    glUniform1i(blockDimLoc, blockSize);  // cube
+    // 8 bits per channel
+    StatsRegistry::instance().setBytes("gpu", "palette texture", PALETTE_ENTRIES * 4);
 }
 
-
 void MyGLWidget::handleLoggedMessage(const QOpenGLDebugMessage &message)
 {
     logGLMessage(message);
@@ -237,6 +400,7 @@ void MyGLWidget::handleLoggedMessage(const QOpenGLDebugMessage &message)
 
 void MyGLWidget::compileShaderCheck(GLuint shader, QString name)
 {
+    ScopedTimer timer("shader compile");
     glCompileShader(shader);
     GLint compiled;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
@@ -253,6 +417,7 @@ void MyGLWidget::compileShaderCheck(GLuint shader, QString name)
 
 void MyGLWidget::linkProgramCheck(GLuint program, QString name)
 {
+    ScopedTimer timer("shader link");
     glLinkProgram(program);
     GLint linked;
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
@@ -308,6 +473,27 @@ void MyGLWidget::mouseMoveEvent(QMouseEvent *event)
         camPitch = -pitchLimit;
 }
 
+void MyGLWidget::mousePressEvent(QMouseEvent *event)
+{
+    if (event->button() != Qt::RightButton || !query)
+        return;
+    // pick the voxel under the cursor, same ray as the vertex shader
+    float aspect = (float)width() / height();
+    glm::vec2 uv((2.0f * event->pos().x() / width() - 1) * aspect,
+                 1 - 2.0f * event->pos().y() / height());
+    glm::mat4 camMatrix = cameraMatrix();
+    glm::vec3 rayDir = glm::vec3(camMatrix * glm::vec4(
+            uv.x * CAM_RIGHT + uv.y * CAM_UP + CAM_FORWARD, 0));
+    RayHit hit = query->castRay(RayQuery{glm::vec3(camPos), glm::normalize(rayDir),
+                                         DRAW_DIST});
+    if (hit.hit) {
+        qDebug() << "Picked voxel" << hit.voxel.x << hit.voxel.y << hit.voxel.z
+                 << "index" << hit.value << "distance" << hit.dist;
+    } else {
+        qDebug() << "Picked nothing";
+    }
+}
+
 void MyGLWidget::mouseReleaseEvent(QMouseEvent *event)
 {
     Q_UNUSED(event);
@@ -329,6 +515,21 @@ void MyGLWidget::keyPressEvent(QKeyEvent *event)
         camVelocity += CAM_UP; break;
     case Qt::Key_Q:
         camVelocity -= CAM_UP; break;
+    case Qt::Key_L:
+        lodEnabled = !lodEnabled;
+        qDebug() << "Level of detail" << (lodEnabled ? "on" : "off");
+        break;
+    case Qt::Key_T:
+        showSteps = !showSteps; break;
+    case Qt::Key_O:
+        ambientOcclusion = (ambientOcclusion + 1) % AO_NUM_MODES;
+        qDebug() << "Ambient occlusion:" << AO_MODE_NAMES[ambientOcclusion];
+        break;
+    case Qt::Key_C:
+        compareAO = true; break;
+    case Qt::Key_M:
+        qDebug().noquote() << QJsonDocument(StatsRegistry::instance().toJson()).toJson();
+        break;
     default:
         QOpenGLWidget::keyPressEvent(event);
     }
@@ -354,16 +555,90 @@ void MyGLWidget::keyReleaseEvent(QKeyEvent *event)
     }
 }
 
-void MyGLWidget::paintGL()
+glm::mat4 MyGLWidget::cameraMatrix() const
 {
-    glBindVertexArray(frameVAO);
-
     glm::mat4 camMatrix = glm::identity<glm::mat4>();
     camMatrix = glm::rotate(camMatrix, camYaw, CAM_UP);
     camMatrix = glm::rotate(camMatrix, camPitch, CAM_RIGHT);
+    return camMatrix;
+}
+
+glm::vec3 MyGLWidget::moveCamera(glm::vec3 pos, glm::vec3 move)
+{
+    // no CPU copy of streamed worlds, and let the camera fly out of walls
+    if (!query || query->overlapSphere(SphereQuery{pos, CAM_RADIUS}))
+        return pos + move;
+
+    // stop at the surface and slide along it, a few times for corners
+    for (int i = 0; i < 3; i++) {
+        float length = glm::length(move);
+        if (length < EPSILON)
+            break;
+        glm::vec3 dir = move / length;
+        RayHit hit = query->castRay(RayQuery{pos, dir, length + CAM_RADIUS});
+        float allowed = hit.hit ? glm::max(hit.dist - CAM_RADIUS, 0.0f) : length;
+        glm::vec3 next = pos + dir * allowed;
+        // the ray only checks the center, don't clip edges on the way
+        if (query->overlapSphere(SphereQuery{next, CAM_RADIUS}))
+            break;
+        pos = next;
+        if (!hit.hit)
+            break;
+        move -= dir * allowed;
+        move -= hit.normal * glm::dot(move, hit.normal);
+    }
+    return pos;
+}
+
+void MyGLWidget::compareAmbientOcclusion()
+{
+    int w = width() * devicePixelRatio(), h = height() * devicePixelRatio();
+    std::vector<unsigned char> images[AO_NUM_MODES];
+    for (int mode = 0; mode < AO_NUM_MODES; mode++) {
+        glUniform1i(ambientOcclusionLoc, mode);
+        GLuint totalMicroseconds = 0;
+        for (int i = 0; i < COMPARE_FRAMES; i++) {
+            glBeginQuery(GL_TIME_ELAPSED, compareQuery);
+            glDrawArrays(GL_TRIANGLES, 0, NUM_FRAME_VERTS);
+            glEndQuery(GL_TIME_ELAPSED);
+            GLuint nanoseconds;
+            glGetQueryObjectuiv(compareQuery, GL_QUERY_RESULT, &nanoseconds);
+            totalMicroseconds += nanoseconds / 1000;
+        }
+        images[mode].resize(w * h * 4);
+        glReadPixels(0, 0, w, h, GL_RGBA, GL_UNSIGNED_BYTE, images[mode].data());
+
+        // per channel, against the feeler rays
+        long long totalDiff = 0;
+        int maxDiff = 0, pixelsDiffer = 0;
+        for (int i = 0; i < w * h; i++) {
+            int pixelDiff = 0;
+            for (int c = 0; c < 3; c++) {
+                int diff = std::abs(images[mode][i * 4 + c] - images[AO_FEELER_RAYS][i * 4 + c]);
+                totalDiff += diff;
+                pixelDiff = std::max(pixelDiff, diff);
+            }
+            maxDiff = std::max(maxDiff, pixelDiff);
+            if (pixelDiff > 2)
+                pixelsDiffer++;
+        }
+        qDebug() << "Ambient occlusion" << AO_MODE_NAMES[mode] << ":"
+                 << (totalMicroseconds / COMPARE_FRAMES) << "us,"
+                 << "mean difference" << (double)totalDiff / (w * h * 3)
+                 << "max" << maxDiff << "," << (100.0 * pixelsDiffer / (w * h))
+                 << "% of pixels differ";
+    }
+}
+
+void MyGLWidget::paintGL()
+{
+    glBindVertexArray(frameVAO);
+
+    glm::mat4 camMatrix = cameraMatrix();
 
     // apply velocity
-    camPos += camMatrix * glm::vec4(camVelocity * FLY_SPEED, 0);
+    glm::vec4 move = camMatrix * glm::vec4(camVelocity * FLY_SPEED, 0);
+    camPos = glm::vec4(moveCamera(glm::vec3(camPos), glm::vec3(move)), 1);
 
     glm::vec4 camDir = camMatrix * glm::vec4(CAM_FORWARD, 0);
     glm::vec4 camU = camMatrix * glm::vec4(CAM_RIGHT, 0);
@@ -373,6 +648,17 @@ void MyGLWidget::paintGL()
     glUniform3f(camULoc, camU.x, camU.y, camU.z);
     glUniform3f(camVLoc, camV.x, camV.y, camV.z);
     glUniform1f(pixelSizeLoc, 2.0 / height());
+    glUniform1f(lodScaleLoc, lodEnabled ? 1.0f : 0.0f);
+    glUniform1i(showStepsLoc, showSteps);
+
+    if (streamer)
+        updateStreaming();
+
+    if (compareAO) {
+        compareAO = false;
+        compareAmbientOcclusion();
+    }
+    glUniform1i(ambientOcclusionLoc, ambientOcclusion);
 
     bool measureTime = frame % 60 == 0;
     if (measureTime) {
@@ -380,7 +666,15 @@ void MyGLWidget::paintGL()
         if (frame != 0) {
             GLuint nanoseconds;
             glGetQueryObjectuiv(timerQuery, GL_QUERY_RESULT, &nanoseconds);
-            qDebug() << (nanoseconds / 1000) << "us";
+            qDebug() << (nanoseconds / 1000) << "us"
+                     << "ambient occlusion:" << AO_MODE_NAMES[ambientOcclusion];
+            if (streamer) {
+                const StreamStats &stats = streamer->stats;
+                int visited = stats.prefetchHits + stats.prefetchMisses;
+                qDebug() << "Chunks loaded" << stats.loaded << "evicted" << stats.evicted
+                         << "prefetch hit rate"
+                         << (visited ? 100 * stats.prefetchHits / visited : 100) << "%";
+            }
         }
         glBeginQuery(GL_TIME_ELAPSED, timerQuery);
     }
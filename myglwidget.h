@@ -10,7 +10,17 @@
 #include <QKeyEvent>
 #include <glm/glm.hpp>
 
+#include <memory>
 #include "voxloader.h"
+#include "voxpreprocess.h"
+#include "voxquery.h"
+#include "worldstreamer.h"
+
+// ambient occlusion modes, must match the shader
+enum AmbientOcclusionMode
+{
+    AO_FEELER_RAYS, AO_DISTANCE_FIELD, AO_NONE, AO_NUM_MODES
+};
 
 class MyGLWidget : public QOpenGLWidget, protected QOpenGLExtraFunctions
 {
@@ -19,6 +29,10 @@ public:
     MyGLWidget(QWidget *parent);
     ~MyGLWidget();
 
+    // stream chunks from a directory instead of loading the default model,
+    // must be called before the widget is shown
+    void setWorldDir(QString dir);
+
 protected:
     // QOpenGLWidget events
     void initializeGL() override;
@@ -26,13 +40,28 @@ protected:
     void paintGL() override;
     // general widget events
     void mouseMoveEvent(QMouseEvent *event) override;
+    void mousePressEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
     void keyPressEvent(QKeyEvent *event) override;
     void keyReleaseEvent(QKeyEvent *event) override;
 
     // get the locations of each uniform
     void getProgramUniforms(GLuint program);
-    void uploadVoxelData(const VoxPack &pack);
+    void uploadVoxelData(const VoxWorld &world, const float *palette);
+    void initStreaming();
+    void updateStreaming();
+    // set uniforms for the layout of blocks, returns texels per block
+    int setBlockLayout(int blockSize);
+    void createModelBuffer(GLsizeiptr size, const void *data, GLenum usage);
+    void uploadPalette(const float *palette);
+
+    // render the current view in every ambient occlusion mode and log the
+    // GPU time and the difference from the feeler rays
+    void compareAmbientOcclusion();
+
+    glm::mat4 cameraMatrix() const;
+    // returns the new position after colliding with the world
+    glm::vec3 moveCamera(glm::vec3 pos, glm::vec3 move);
 
     // OpenGL helper functions
     void compileShaderCheck(GLuint shader, QString name);
@@ -46,22 +75,39 @@ private slots:
 private:
     GLuint frameVAO;
     GLuint framePosBuffer, frameUVBuffer;
-    GLuint modelBuffer, modelTexture, paletteTexture;
+    GLuint modelBuffer = 0, modelTexture = 0, paletteTexture = 0;
+    // only created for some worlds, 0 is ignored when deleting
+    GLuint sceneBVHBuffer = 0, sceneBVHTexture = 0;
+    GLuint sceneInstanceBuffer = 0, sceneInstanceTexture = 0;
+    GLuint chunkTableBuffer = 0, chunkTableTexture = 0;
     GLuint program;
-    GLuint timerQuery;
+    GLuint timerQuery, compareQuery;
     // shader uniform locations
     GLint modelLoc, paletteLoc, blockDimLoc;
+    GLint mipOffsetLoc, mipLevelsLoc, blockTexelsLoc, lodScaleLoc, showStepsLoc;
+    GLint ambientOcclusionLoc;
+    GLint sceneBVHLoc, sceneInstancesLoc, sceneNodeCountLoc;
+    GLint chunkTableLoc, chunkGridDimLoc, chunkWindowMinLoc, chunkWindowDimLoc;
     GLint camPosLoc, camDirLoc, camULoc, camVLoc, pixelSizeLoc;
     GLint ambientColorLoc, sunDirLoc, sunColorLoc;
     GLint pointLightPosLoc, pointLightColorLoc, pointLightRangeLoc;
 
     int frame = 0;
+    bool lodEnabled = true;
+    bool showSteps = false;  // draw step count instead of color
+    int ambientOcclusion = AO_DISTANCE_FIELD;
+    bool compareAO = false;  // on the next frame
     bool trackMouse = false;
     QPoint prevMousePos;
     float camYaw = 0, camPitch = 0;
     glm::vec4 camPos = glm::vec4(8,8,8,1);
     glm::vec3 camVelocity = glm::vec3(0,0,0);
 
+    QString worldDir;
+    std::unique_ptr<WorldStreamer> streamer;
+    std::unique_ptr<VoxWorld> world;
+    std::unique_ptr<VoxQuery> query;  // references world
+
     QOpenGLDebugLogger logger;
 };
 
@@ -13,14 +13,24 @@ SOURCES += \
     mainwindow.cpp \
     myglwidget.cpp \
     opengllog.cpp \
-    voxloader.cpp
+    scenebvh.cpp \
+    stats.cpp \
+    voxloader.cpp \
+    voxpreprocess.cpp \
+    voxquery.cpp \
+    worldstreamer.cpp
 
 HEADERS += \
     mainwindow.h \
     myglwidget.h \
     opengllog.h \
+    scenebvh.h \
+    stats.h \
     util.h \
-    voxloader.h
+    voxloader.h \
+    voxpreprocess.h \
+    voxquery.h \
+    worldstreamer.h
 
 FORMS +=
 
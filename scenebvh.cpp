@@ -0,0 +1,65 @@
+#include "scenebvh.h"
+#include <algorithm>
+
+static void buildNode(std::vector<BVHNode> &nodes,
+                      const std::vector<VoxInstance> &instances,
+                      std::vector<int>::iterator begin,
+                      std::vector<int>::iterator end);
+
+std::vector<BVHNode> buildSceneBVH(const std::vector<VoxInstance> &instances)
+{
+    std::vector<BVHNode> nodes;
+    if (instances.empty())
+        return nodes;
+    std::vector<int> order(instances.size());
+    for (int i = 0; i < order.size(); i++)
+        order[i] = i;
+    nodes.reserve(instances.size() * 2 - 1);
+    buildNode(nodes, instances, order.begin(), order.end());
+    return nodes;
+}
+
+void buildNode(std::vector<BVHNode> &nodes,
+               const std::vector<VoxInstance> &instances,
+               std::vector<int>::iterator begin,
+               std::vector<int>::iterator end)
+{
+    int nodeI = nodes.size();
+    nodes.emplace_back();
+    BVHNode node;
+    node.boundsMin = instances[*begin].boundsMin;
+    node.boundsMax = instances[*begin].boundsMax;
+    // centers are doubled to stay in integers
+    glm::ivec3 centerMin = node.boundsMin + node.boundsMax;
+    glm::ivec3 centerMax = centerMin;
+    for (auto it = begin; it != end; it++) {
+        const VoxInstance &instance = instances[*it];
+        node.boundsMin = glm::min(node.boundsMin, instance.boundsMin);
+        node.boundsMax = glm::max(node.boundsMax, instance.boundsMax);
+        glm::ivec3 center = instance.boundsMin + instance.boundsMax;
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+    }
+
+    if (end - begin == 1) {
+        node.instance = *begin;
+    } else {
+        node.instance = -1;
+        // median split along the longest axis of the centers
+        glm::ivec3 extent = centerMax - centerMin;
+        int axis = 0;
+        if (extent.y > extent[axis])
+            axis = 1;
+        if (extent.z > extent[axis])
+            axis = 2;
+        auto mid = begin + (end - begin) / 2;
+        std::nth_element(begin, mid, end, [&](int a, int b) {
+            return instances[a].boundsMin[axis] + instances[a].boundsMax[axis]
+                    < instances[b].boundsMin[axis] + instances[b].boundsMax[axis];
+        });
+        buildNode(nodes, instances, begin, mid);
+        buildNode(nodes, instances, mid, end);
+    }
+    node.skip = nodes.size();
+    nodes[nodeI] = node;
+}
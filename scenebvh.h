@@ -0,0 +1,19 @@
+#ifndef SCENEBVH_H
+#define SCENEBVH_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "voxloader.h"
+
+// nodes are stored depth first, so a ray that hits a node continues to the
+// next node in the array, and a ray that misses jumps to skip
+struct BVHNode
+{
+    glm::ivec3 boundsMin, boundsMax;
+    int instance;  // index in VoxPack::instances, or -1 for interior nodes
+    int skip;  // index of the first node after this subtree
+};
+
+std::vector<BVHNode> buildSceneBVH(const std::vector<VoxInstance> &instances);
+
+#endif // SCENEBVH_H
@@ -0,0 +1,76 @@
+#include "stats.h"
+#include <QFile>
+#include <QJsonDocument>
+#include <QDebug>
+
+StatsRegistry &StatsRegistry::instance()
+{
+    static StatsRegistry registry;
+    return registry;
+}
+
+void StatsRegistry::setBytes(const QString &category, const QString &name, qint64 bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Memory &m = memory[category];
+    auto it = m.entries.find(name);
+    if (it != m.entries.end()) {
+        m.current -= it->second;
+        m.entries.erase(it);
+    }
+    if (bytes != 0) {
+        m.entries[name] = bytes;
+        m.current += bytes;
+    }
+    if (m.current > m.peak)
+        m.peak = m.current;
+}
+
+void StatsRegistry::addTime(const QString &name, qint64 nsecs)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    Timer &t = timers[name];
+    t.count++;
+    t.totalNsecs += nsecs;
+    if (nsecs > t.maxNsecs)
+        t.maxNsecs = nsecs;
+}
+
+QJsonObject StatsRegistry::toJson() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    QJsonObject memoryJson;
+    for (auto &category : memory) {
+        QJsonObject entries;
+        for (auto &entry : category.second.entries)
+            entries[entry.first] = entry.second;
+        QJsonObject categoryJson;
+        categoryJson["current_bytes"] = category.second.current;
+        categoryJson["peak_bytes"] = category.second.peak;
+        categoryJson["held"] = entries;
+        memoryJson[category.first] = categoryJson;
+    }
+    QJsonObject timersJson;
+    for (auto &timer : timers) {
+        QJsonObject timerJson;
+        timerJson["count"] = timer.second.count;
+        timerJson["total_ms"] = timer.second.totalNsecs / 1e6;
+        timerJson["max_ms"] = timer.second.maxNsecs / 1e6;
+        timersJson[timer.first] = timerJson;
+    }
+    QJsonObject json;
+    json["memory"] = memoryJson;
+    json["timers"] = timersJson;
+    return json;
+}
+
+bool StatsRegistry::dump(const QString &filename) const
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Text)) {
+        qWarning() << "Error writing stats to" << filename;
+        return false;
+    }
+    f.write(QJsonDocument(toJson()).toJson());
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <QString>
+#include <QJsonObject>
+#include <QElapsedTimer>
+#include <map>
+#include <mutex>
+#include "util.h"
+
+// Memory held and time spent, by name, for the whole program.
+// Safe to use from any thread.
+class StatsRegistry : noncopyable
+{
+public:
+    static StatsRegistry &instance();
+
+    // set the bytes currently held by an entry in a category ("cpu" or "gpu"),
+    // 0 removes it, so anything still listed at exit was never released
+    void setBytes(const QString &category, const QString &name, qint64 bytes);
+    void addTime(const QString &name, qint64 nsecs);
+
+    QJsonObject toJson() const;
+    bool dump(const QString &filename) const;
+
+private:
+    StatsRegistry() = default;
+
+    struct Memory
+    {
+        qint64 current = 0, peak = 0;
+        std::map<QString, qint64> entries;
+    };
+    struct Timer
+    {
+        qint64 count = 0, totalNsecs = 0, maxNsecs = 0;
+    };
+
+    mutable std::mutex mutex;
+    std::map<QString, Memory> memory;
+    std::map<QString, Timer> timers;
+};
+
+// adds the time until it goes out of scope to a timer
+class ScopedTimer : noncopyable
+{
+public:
+    ScopedTimer(QString name)
+        : name(name) { timer.start(); }
+    ~ScopedTimer() { StatsRegistry::instance().addTime(name, timer.nsecsElapsed()); }
+
+private:
+    QString name;
+    QElapsedTimer timer;
+};
+
+#endif // STATS_H
@@ -0,0 +1,251 @@
+#include <QCoreApplication>
+#include <QDebug>
+#include <random>
+#include "scenebvh.h"
+#include "voxpreprocess.h"
+#include "voxquery.h"
+
+static const int BLOCK_SIZE = 8;
+static const float TOLERANCE = 0.001f;
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        qWarning().nospace() << __FILE__ << ":" << __LINE__ << ": failed: " << #cond; \
+        failures++; \
+    } \
+} while (0)
+
+static bool near(float a, float b)
+{
+    return std::abs(a - b) < TOLERANCE;
+}
+
+static bool near(glm::vec3 a, glm::vec3 b)
+{
+    return near(a.x, b.x) && near(a.y, b.y) && near(a.z, b.z);
+}
+
+// blocks of air, fill them with setVoxel() then call preprocess()
+static void initWorld(VoxWorld &world, int numBlocks)
+{
+    world.blockSize = BLOCK_SIZE;
+    world.blockTexels = BlockMipOffset(BLOCK_SIZE, BlockMipLevels(BLOCK_SIZE));
+    world.udfVoxData.assign((size_t)numBlocks * world.blockTexels * 2, INDEX_AIR);
+}
+
+static void setVoxel(VoxWorld &world, int block, int x, int y, int z, int value)
+{
+    world.udfVoxData[(size_t)block * world.blockTexels * 2
+            + UDF_INDEX(x, y, z, world.blockSize)] = value;
+}
+
+static void preprocess(VoxWorld &world)
+{
+    int numBlocks = world.udfVoxData.size() / (world.blockTexels * 2);
+    for (int block = 0; block < numBlocks; block++)
+        PreprocessBlock(world.udfVoxData.data() + (size_t)block * world.blockTexels * 2,
+                        world.blockSize);
+}
+
+static void checkHit(const RayHit &hit, int value, glm::ivec3 voxel,
+                     glm::vec3 normal, float dist)
+{
+    CHECK(hit.hit);
+    CHECK(hit.value == value);
+    CHECK(hit.voxel == voxel);
+    CHECK(near(hit.normal, normal));
+    CHECK(near(hit.dist, dist));
+}
+
+static void checkMiss(const RayHit &hit, float maxDist)
+{
+    CHECK(!hit.hit);
+    CHECK(hit.value == INDEX_AIR);
+    CHECK(near(hit.dist, maxDist));
+}
+
+// block 0 is the world, repeating every BLOCK_SIZE voxels
+static void testFullResolution()
+{
+    VoxWorld world;
+    initWorld(world, 1);
+    setVoxel(world, 0, 3, 2, 1, 5);
+    preprocess(world);
+    VoxQuery query(world);
+
+    checkHit(query.castRay(RayQuery{glm::vec3(0.5, 2.5, 1.5), glm::vec3(1, 0, 0), 6}),
+             5, glm::ivec3(3, 2, 1), glm::vec3(-1, 0, 0), 2.5);
+    checkHit(query.castRay(RayQuery{glm::vec3(3.5, 2.5, 6), glm::vec3(0, 0, -1), 6}),
+             5, glm::ivec3(3, 2, 1), glm::vec3(0, 0, 1), 4);
+    // the next copy of the voxel is past maxDist
+    checkMiss(query.castRay(RayQuery{glm::vec3(0.5, 4.5, 1.5), glm::vec3(1, 0, 0), 6}), 6);
+    checkMiss(query.castRay(RayQuery{glm::vec3(4.5, 2.5, 1.5), glm::vec3(1, 0, 0), 6}), 6);
+
+    CHECK(query.overlapSphere(SphereQuery{glm::vec3(3.5, 2.5, 1.5), 0.3f}));
+    CHECK(query.overlapSphere(SphereQuery{glm::vec3(2.5, 2.5, 1.5), 0.6f}));
+    CHECK(!query.overlapSphere(SphereQuery{glm::vec3(2.5, 2.5, 1.5), 0.4f}));
+    CHECK(!query.overlapSphere(SphereQuery{glm::vec3(5.5, 5.5, 5.5), 1.5f}));
+    CHECK(query.overlapBox(BoxQuery{glm::vec3(3.2, 2.2, 1.2), glm::vec3(3.8, 2.8, 1.8)}));
+    CHECK(query.overlapBox(BoxQuery{glm::vec3(0, 0, 0), glm::vec3(3.1, 2.1, 1.1)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(0, 0, 0), glm::vec3(3, 2, 1)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(4, 4, 4), glm::vec3(7, 7, 7)}));
+}
+
+// block 0 holds block 1 in one voxel, which is solid below its half way
+static void testNestedBlock()
+{
+    VoxWorld world;
+    initWorld(world, 2);
+    setVoxel(world, 0, 4, 4, 4, INDEX_INSTANCE + 1);
+    for (int z = 0; z < BLOCK_SIZE / 2; z++)
+        for (int y = 0; y < BLOCK_SIZE; y++)
+            for (int x = 0; x < BLOCK_SIZE; x++)
+                setVoxel(world, 1, x, y, z, 9);
+    preprocess(world);
+    VoxQuery query(world);
+
+    // through the empty top half of the nested block to the solid half
+    checkHit(query.castRay(RayQuery{glm::vec3(4.5, 4.5, 6), glm::vec3(0, 0, -1), 4}),
+             9, glm::ivec3(4, 4, 4), glm::vec3(0, 0, 1), 1.5);
+    checkHit(query.castRay(RayQuery{glm::vec3(2, 4.5, 4.25), glm::vec3(1, 0, 0), 4}),
+             9, glm::ivec3(4, 4, 4), glm::vec3(-1, 0, 0), 2);
+    checkMiss(query.castRay(RayQuery{glm::vec3(2, 4.5, 4.75), glm::vec3(1, 0, 0), 4}), 4);
+
+    CHECK(query.overlapSphere(SphereQuery{glm::vec3(4.5, 4.5, 4.25), 0.1f}));
+    CHECK(!query.overlapSphere(SphereQuery{glm::vec3(4.5, 4.5, 4.75), 0.1f}));
+    CHECK(query.overlapBox(BoxQuery{glm::vec3(4.2, 4.2, 4.4), glm::vec3(4.8, 4.8, 4.6)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(4.2, 4.2, 4.6), glm::vec3(4.8, 4.8, 4.9)}));
+}
+
+// blocks 1 to 4 each hold the next one in their first voxel, starting
+// from one voxel of block 0, and only the first voxel of block 4 is solid
+static void testDeepestNesting()
+{
+    VoxWorld world;
+    initWorld(world, 5);
+    setVoxel(world, 0, 4, 4, 4, INDEX_INSTANCE + 1);
+    for (int block = 1; block < 4; block++)
+        setVoxel(world, block, 0, 0, 0, INDEX_INSTANCE + block + 1);
+    setVoxel(world, 4, 0, 0, 0, 9);
+    preprocess(world);
+    VoxQuery query(world);
+
+    // one voxel of block 4
+    float voxel = 1.0f / (BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE);
+    float solid = 4 + 0.5f * voxel;
+    float air = 4 + 3.5f * voxel;
+    checkHit(query.castRay(RayQuery{glm::vec3(3.5, solid, solid), glm::vec3(1, 0, 0), 1}),
+             9, glm::ivec3(4, 4, 4), glm::vec3(-1, 0, 0), 0.5);
+    checkMiss(query.castRay(RayQuery{glm::vec3(3.5, air, air), glm::vec3(1, 0, 0), 1}), 1);
+    // queries see the same deepest level as rays
+    CHECK(query.overlapSphere(SphereQuery{glm::vec3(solid), 0.4f * voxel}));
+    CHECK(!query.overlapSphere(SphereQuery{glm::vec3(air), 0.4f * voxel}));
+    CHECK(query.overlapBox(BoxQuery{glm::vec3(solid - 0.4f * voxel),
+                                    glm::vec3(solid + 0.4f * voxel)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(air - 0.4f * voxel),
+                                     glm::vec3(air + 0.4f * voxel)}));
+}
+
+// an 8x4x2 model turned a quarter around z, so local x runs along world y
+// and local y along world -x
+static void initRotatedScene(VoxWorld &world)
+{
+    initWorld(world, 1);
+    setVoxel(world, 0, 6, 1, 0, 7);
+    preprocess(world);
+
+    VoxInstance instance;
+    instance.model = 0;
+    instance.rotation = glm::mat3(glm::vec3(0, 1, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 0, 1));
+    instance.origin = glm::ivec3(20, 0, 0);
+    instance.boundsMin = glm::ivec3(16, 0, 0);
+    instance.boundsMax = glm::ivec3(20, 8, 2);
+    world.instances.push_back(BlockInstance{
+        0, instance.rotation, instance.origin, glm::ivec3(8, 4, 2)});
+    world.bvh = buildSceneBVH({instance});
+}
+
+static void testRotatedInstance()
+{
+    VoxWorld world;
+    initRotatedScene(world);
+    VoxQuery query(world);
+
+    // local voxel (6, 1, 0) is world voxel (18, 6, 0)
+    checkHit(query.castRay(RayQuery{glm::vec3(10, 6.5, 0.5), glm::vec3(1, 0, 0), 20}),
+             7, glm::ivec3(18, 6, 0), glm::vec3(-1, 0, 0), 8);
+    checkHit(query.castRay(RayQuery{glm::vec3(18.5, 6.5, 5), glm::vec3(0, 0, -1), 20}),
+             7, glm::ivec3(18, 6, 0), glm::vec3(0, 0, 1), 4);
+    checkHit(query.castRay(RayQuery{glm::vec3(18.5, 0, 0.5), glm::vec3(0, 1, 0), 20}),
+             7, glm::ivec3(18, 6, 0), glm::vec3(0, -1, 0), 6);
+    // inside the instance bounds but not the voxel
+    checkMiss(query.castRay(RayQuery{glm::vec3(10, 5.5, 0.5), glm::vec3(1, 0, 0), 20}), 20);
+    // outside the instance, where the block would wrap around
+    checkMiss(query.castRay(RayQuery{glm::vec3(10, 14.5, 0.5), glm::vec3(1, 0, 0), 20}), 20);
+
+    CHECK(query.overlapSphere(SphereQuery{glm::vec3(18.5, 6.5, 0.5), 0.2f}));
+    CHECK(!query.overlapSphere(SphereQuery{glm::vec3(16.5, 6.5, 0.5), 0.2f}));
+    CHECK(query.overlapBox(BoxQuery{glm::vec3(18.2, 6.2, 0.2), glm::vec3(18.8, 6.8, 0.8)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(16.2, 6.2, 0.2), glm::vec3(16.8, 6.8, 0.8)}));
+    CHECK(!query.overlapBox(BoxQuery{glm::vec3(18.2, 14.2, 0.2), glm::vec3(18.8, 14.8, 0.8)}));
+}
+
+// the batch versions split the work across threads, they must give the
+// same answers as one query at a time
+static void testBatches()
+{
+    VoxWorld world;
+    initRotatedScene(world);
+    VoxQuery query(world);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> position(10, 24);
+    std::normal_distribution<float> direction;
+    std::vector<RayQuery> rays;
+    std::vector<SphereQuery> spheres;
+    std::vector<BoxQuery> boxes;
+    for (int i = 0; i < 1000; i++) {
+        glm::vec3 origin(position(rng), position(rng) - 10, position(rng) - 10);
+        glm::vec3 dir(direction(rng), direction(rng), direction(rng));
+        rays.push_back(RayQuery{origin, glm::normalize(dir), 20});
+        spheres.push_back(SphereQuery{origin, 1.5f});
+        boxes.push_back(BoxQuery{origin - 1.5f, origin + 1.5f});
+    }
+
+    std::vector<RayHit> hits = query.castRays(rays);
+    std::vector<char> sphereResults = query.overlapSpheres(spheres);
+    std::vector<char> boxResults = query.overlapBoxes(boxes);
+    CHECK(hits.size() == rays.size());
+    int numHits = 0;
+    for (int i = 0; i < rays.size(); i++) {
+        RayHit hit = query.castRay(rays[i]);
+        CHECK(hits[i].hit == hit.hit);
+        CHECK(hits[i].value == hit.value);
+        CHECK(hits[i].voxel == hit.voxel);
+        CHECK(hits[i].normal == hit.normal);
+        CHECK(hits[i].dist == hit.dist);
+        CHECK(sphereResults[i] == query.overlapSphere(spheres[i]));
+        CHECK(boxResults[i] == query.overlapBox(boxes[i]));
+        numHits += hit.hit;
+    }
+    // otherwise the comparison proves nothing
+    CHECK(numHits > 0);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    testFullResolution();
+    testNestedBlock();
+    testDeepestNesting();
+    testRotatedInstance();
+    testBatches();
+    if (failures) {
+        qWarning() << failures << "checks failed";
+        return EXIT_FAILURE;
+    }
+    qDebug() << "All tests passed";
+    return EXIT_SUCCESS;
+}
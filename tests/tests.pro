@@ -0,0 +1,26 @@
+# Unit tests for the CPU queries, without OpenGL
+# qmake tests.pro && make && ./voxtests
+
+QT = core
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+TARGET = voxtests
+
+INCLUDEPATH += .. ../Libraries
+
+SOURCES += \
+    main.cpp \
+    ../scenebvh.cpp \
+    ../stats.cpp \
+    ../voxloader.cpp \
+    ../voxpreprocess.cpp \
+    ../voxquery.cpp
+
+HEADERS += \
+    ../scenebvh.h \
+    ../stats.h \
+    ../util.h \
+    ../voxloader.h \
+    ../voxpreprocess.h \
+    ../voxquery.h
@@ -1,6 +1,11 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 class noncopyable {
 protected:
     noncopyable() = default;
@@ -12,4 +17,30 @@ protected:
     noncopyable &operator=(noncopyable &&) = default;
 };
 
+// call fn(i) for every i in [0, count) across up to one thread per core.
+// threads take the next index as they finish, so uneven items balance out.
+// runs on the calling thread if there are fewer than minPerThread items each
+template<typename Fn>
+void parallelFor(int count, int minPerThread, Fn fn)
+{
+    int numThreads = std::max(1, (int)std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads, count / std::max(1, minPerThread));
+    if (numThreads <= 1) {
+        for (int i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+    std::atomic<int> next(0);
+    auto work = [&] {
+        for (int i = next++; i < count; i = next++)
+            fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++)
+        threads.emplace_back(work);
+    work();
+    for (auto &thread : threads)
+        thread.join();
+}
+
 #endif // UTIL_H
@@ -1,22 +1,105 @@
 #include "voxloader.h"
 
 #include <QDebug>
+#include <algorithm>
+#include <cstdio>
+#include <limits>
 #include <glm/glm.hpp>
+#include "stats.h"
 
 // https://github.com/ephtracy/voxel-model/blob/master/MagicaVoxel-file-format-vox.txt
 // https://github.com/ephtracy/voxel-model/blob/master/MagicaVoxel-file-format-vox-extension.txt
 
-VoxLoader::VoxLoader(QString filename)
-    : file(filename)
+// guards against cycles in malformed scene graphs
+static const int MAX_SCENE_DEPTH = 64;
+// fewest models worth starting a thread for
+static const int MIN_THREAD_MODELS = 4;
+
+static glm::mat3 decodeRotation(int r);
+static int fitBlockSize(const VoxModel &model, int blockSize);
+
+int BlockMipLevels(int blockSize)
+{
+    int levels = 0;
+    for (int dim = blockSize; dim >= 1; dim /= 2)
+        levels++;
+    return levels;
+}
+
+int BlockMipOffset(int blockSize, int level)
+{
+    int offset = 0;
+    for (int i = 0; i < level; i++) {
+        int dim = blockSize >> i;
+        offset += dim * dim * dim;
+    }
+    return offset;
+}
+
+bool VoxPack::allocateBlocks(int numBlocks, int minBlockSize)
+{
+    // blocks are cubes with power of two size, smaller models are padded
+    blockSize = minBlockSize;
+    for (auto &model : models) {
+        if (model.block >= 0)
+            blockSize = fitBlockSize(model, blockSize);
+    }
+    if (blockSize > MAX_BLOCK_SIZE) {
+        qWarning() << "Models bigger than" << MAX_BLOCK_SIZE << "aren't supported";
+        return false;
+    }
+    blockTexels = BlockMipOffset(blockSize, BlockMipLevels(blockSize));
+    if ((qint64)blockTexels * numBlocks > MAX_MODEL_TEXELS) {
+        qWarning() << numBlocks << "blocks of size" << blockSize
+                   << "are too big for the model buffer";
+        return false;
+    }
+    blockData.assign((size_t)blockTexels * numBlocks * 2, 0);
+    return true;
+}
+
+void VoxPack::accountMemory(bool held) const
+{
+    if (name.isEmpty())
+        return;
+    auto &stats = StatsRegistry::instance();
+    QString key = "VoxPack " + name;
+    stats.setBytes("cpu", key + " blocks", held ? blockData.capacity() : 0);
+    qint64 sceneBytes = sizeof(VoxPack)
+            + models.capacity() * sizeof(VoxModel)
+            + orderedModels.capacity() * sizeof(int)
+            + instances.capacity() * sizeof(VoxInstance);
+    stats.setBytes("cpu", key, held ? sceneBytes : 0);
+}
+
+VoxLoader::VoxLoader(QString filename, int minBlockSize)
+    : file(filename), minBlockSize(minBlockSize)
 {
     file.open(QIODevice::ReadOnly);
+    pack.name = filename;
+}
+
+VoxLoader::~VoxLoader()
+{
+    pack.accountMemory(false);
 }
 
 bool VoxLoader::load()
+{
+    ScopedTimer timer("parse");
+    bool ok = readFile();
+    if (ok)
+        pack.accountMemory(true);
+    return ok;
+}
+
+bool VoxLoader::readFile()
 {
     char fourcc[5]{0,0,0,0,0};
     file.read(fourcc, 4);
 
+    if (strncmp(fourcc, "XRAW", 4) == 0)
+        return readXRAW();
     if (strncmp(fourcc, "VOX ", 4) != 0) {
         qWarning() << "Bad magic!";
         return false;
@@ -26,6 +109,7 @@ bool VoxLoader::load()
     file.read((char *)&version, 4);
     qDebug() << "Version:" << version;
 
+    // index pass, only model sizes and scene nodes are read
     if (!readChunk())
         return false;
 
@@ -49,13 +133,201 @@ bool VoxLoader::load()
         }
 
         if (order + 1 > pack.orderedModels.size())
-            pack.orderedModels.resize(order + 1);
-        pack.orderedModels[order] = &pack.models[modelID];
+            pack.orderedModels.resize(order + 1, -1);
+        pack.orderedModels[order] = modelID;
+        t.order = order;
         qDebug() << "Order" << order << "-> model" << modelID;
     }
-    return true;
+
+    if (transforms.empty()) {
+        // no scene graph (older files), every model sits at the origin
+        for (int i = 0; i < pack.models.size(); i++)
+            addInstance(i, glm::mat3(1), glm::ivec3(0));
+    } else {
+        // node 0 is always the root transform
+        flattenNode(0, glm::mat3(1), glm::ivec3(0), 0);
+    }
+    qDebug() << "Num instances:" << pack.instances.size();
+
+    // the scene only needs model sizes, so blocks can be laid out before
+    // any voxels are decoded straight into them
+    return allocateBlocks() && decodeVoxels();
+}
+
+bool VoxLoader::allocateBlocks()
+{
+    blockModels.assign(pack.orderedModels.begin(), pack.orderedModels.end());
+    int orderedBlockSize = minBlockSize;
+    for (int i = 0; i < blockModels.size(); i++) {
+        int modelID = blockModels[i];
+        if (modelID >= 0 && pack.models[modelID].block < 0) {
+            pack.models[modelID].block = i;
+            orderedBlockSize = fitBlockSize(pack.models[modelID], orderedBlockSize);
+        }
+    }
+    // ordered blocks nest inside each other at the block size, so a bigger
+    // instanced model would change what they look like. leave it out instead
+    if (!blockModels.empty()) {
+        auto tooBig = [&](const VoxInstance &instance) {
+            const VoxModel &model = pack.models[instance.model];
+            if (fitBlockSize(model, orderedBlockSize) == orderedBlockSize)
+                return false;
+            qWarning() << "Instance of model" << instance.model
+                       << "is bigger than the ordered blocks, skipped";
+            return true;
+        };
+        pack.instances.erase(std::remove_if(pack.instances.begin(), pack.instances.end(),
+                                            tooBig), pack.instances.end());
+    }
+    for (auto &instance : pack.instances) {
+        VoxModel &model = pack.models[instance.model];
+        if (model.block < 0) {
+            model.block = blockModels.size();
+            blockModels.push_back(instance.model);
+        }
+    }
+    return pack.allocateBlocks(blockModels.size(), minBlockSize);
+}
+
+void VoxLoader::buildVoxelRemap()
+{
+    // palette indices from INDEX_INSTANCE are always nested blocks, even in
+    // models placed by the scene. any that don't refer to an ordered block
+    // are plain colors, use the closest one the renderer can show
+    for (int i = 0; i < PALETTE_ENTRIES; i++) {
+        voxelRemap[i] = i;
+        int block = i - INDEX_INSTANCE;
+        if (block < 0 || (block < pack.orderedModels.size()
+                          && pack.orderedModels[block] >= 0))
+            continue;
+        const float *color = pack.palette + i * 4;
+        float bestDist = std::numeric_limits<float>::max();
+        for (int c = 1; c < INDEX_SKY; c++) {
+            const float *other = pack.palette + c * 4;
+            glm::vec3 d(other[0] - color[0], other[1] - color[1], other[2] - color[2]);
+            if (glm::dot(d, d) < bestDist) {
+                bestDist = glm::dot(d, d);
+                voxelRemap[i] = c;
+            }
+        }
+    }
 }
 
+void VoxLoader::flattenNode(int nodeID, const glm::mat3 &rotation,
+                            glm::ivec3 translation, int depth)
+{
+    if (depth > MAX_SCENE_DEPTH) {
+        qWarning() << "Scene graph too deep at node" << nodeID;
+        return;
+    }
+
+    if (transformNodes.count(nodeID)) {
+        const VoxTransform &t = transforms[transformNodes[nodeID]];
+        // ordered blocks are only referenced by index, not placed in the world
+        if (t.hidden || t.order >= 0)
+            return;
+        flattenNode(t.child, rotation * t.rotation,
+                    translation + glm::ivec3(rotation * glm::vec3(t.translation)),
+                    depth + 1);
+    } else if (groupNodeChildren.count(nodeID)) {
+        for (int child : groupNodeChildren[nodeID])
+            flattenNode(child, rotation, translation, depth + 1);
+    } else if (shapeNodeModels.count(nodeID)) {
+        int modelID = shapeNodeModels[nodeID];
+        if (modelID < 0 || modelID >= pack.models.size()) {
+            qWarning() << "Invalid model ID" << modelID;
+            return;
+        }
+        addInstance(modelID, rotation, translation);
+    } else {
+        qWarning() << "Missing scene node" << nodeID;
+    }
+}
+
+void VoxLoader::addInstance(int modelID, const glm::mat3 &rotation,
+                            glm::ivec3 translation)
+{
+    const VoxModel &model = pack.models[modelID];
+    glm::ivec3 size(model.xDim, model.yDim, model.zDim);
+    VoxInstance instance;
+    instance.model = modelID;
+    instance.rotation = rotation;
+    // translation is the position of the model's center
+    instance.origin = translation - glm::ivec3(rotation * glm::vec3(size / 2));
+    glm::ivec3 corner = instance.origin + glm::ivec3(rotation * glm::vec3(size));
+    instance.boundsMin = glm::min(instance.origin, corner);
+    instance.boundsMax = glm::max(instance.origin, corner);
+    pack.instances.push_back(instance);
+}
+
+
+// XRAW: channel type, channel count, bits per channel, bits per index,
+// then the size and palette size as int32, voxel indices and palette
+bool VoxLoader::readXRAW()
+{
+    uint8_t channelType, numChannels, bitsPerChannel, bitsPerIndex;
+    int32_t xDim, yDim, zDim, numColors;
+    file.read((char *)&channelType, 1);
+    file.read((char *)&numChannels, 1);
+    file.read((char *)&bitsPerChannel, 1);
+    file.read((char *)&bitsPerIndex, 1);
+    file.read((char *)&xDim, 4);
+    file.read((char *)&yDim, 4);
+    file.read((char *)&zDim, 4);
+    file.read((char *)&numColors, 4);
+    qDebug() << "XRAW size:" << xDim << yDim << zDim;
+    if (xDim <= 0 || yDim <= 0 || zDim <= 0) {
+        qWarning() << "Bad XRAW size!";
+        return false;
+    }
+    if (channelType != 0 || numChannels != 4 || bitsPerChannel != 8
+            || bitsPerIndex != 8 || numColors != PALETTE_ENTRIES) {
+        qWarning() << "Unsupported XRAW format, only 8 bit palettes";
+        return false;
+    }
+
+    // the palette comes after the voxels, but is needed to decode them
+    qint64 voxelStart = file.pos();
+    uint8_t pal[PALETTE_SIZE];
+    file.seek(voxelStart + (qint64)xDim * yDim * zDim);
+    if (file.read((char *)pal, PALETTE_SIZE) != PALETTE_SIZE) {
+        qWarning() << "XRAW file too short!";
+        return false;
+    }
+    file.seek(voxelStart);
+    // index 0 is air, there is no offset like in .vox
+    for (int i = 0; i < 4; i++)
+        pack.palette[i] = 0;
+    for (int i = 4; i < PALETTE_SIZE; i++)
+        pack.palette[i] = glm::pow(pal[i] / 256.0, 2.2);
+
+    if (xDim == yDim && zDim % xDim == 0) {
+        // cubic blocks stacked along z, in order
+        for (int i = 0; i < zDim / xDim; i++) {
+            pack.models.emplace_back(xDim, xDim, xDim);
+            pack.orderedModels.push_back(i);
+        }
+    } else {
+        pack.models.emplace_back(xDim, yDim, zDim);
+        addInstance(0, glm::mat3(1), glm::ivec3(0));
+    }
+    if (!allocateBlocks())
+        return false;
+    buildVoxelRemap();
+
+    // straight into the blocks, a row at a time
+    std::vector<uchar> row(xDim);
+    int modelZDim = pack.models[0].zDim;
+    for (int z = 0; z < zDim; z++) {
+        const VoxModel &model = pack.models[z / modelZDim];
+        for (int y = 0; y < yDim; y++) {
+            file.read((char *)row.data(), xDim);
+            for (int x = 0; x < xDim; x++)
+                pack.voxel(model, x, y, z % modelZDim) = voxelRemap[row[x]];
+        }
+    }
+    return true;
+}
 
 bool VoxLoader::readChunk()
 {
@@ -64,17 +336,23 @@ bool VoxLoader::readChunk()
     file.read(id, 4);
     file.read((char *)&contentBytes, 4);
     file.read((char *)&childBytes, 4);
-    int startData = file.pos();
-    int endData = startData + contentBytes + childBytes;
+    qint64 startData = file.pos();
+    qint64 endData = startData + contentBytes + childBytes;
+    if (contentBytes < 0 || childBytes < 0 || endData > file.size()) {
+        qWarning() << "Bad chunk size!";
+        return false;
+    }
 
     if (strncmp(id, "SIZE", 4) == 0 && !readSIZE())
         return false;
-    if (strncmp(id, "XYZI", 4) == 0 && !readXYZI())
+    if (strncmp(id, "XYZI", 4) == 0 && !readXYZI(contentBytes))
         return false;
     if (strncmp(id, "RGBA", 4) == 0 && !readRGBA())
         return false;
     if (strncmp(id, "nTRN", 4) == 0 && !readnTRN())
         return false;
+    if (strncmp(id, "nGRP", 4) == 0 && !readnGRP())
+        return false;
     if (strncmp(id, "nSHP", 4) == 0 && !readnSHP())
         return false;
 
@@ -88,35 +366,81 @@ bool VoxLoader::readChunk()
 }
 
 
+bool VoxLoader::decodeVoxels()
+{
+    // threads can't share the file, so read from memory
+    const uchar *fileData = file.map(0, file.size());
+    QByteArray fileBytes;
+    if (!fileData) {  // compressed resources can't be mapped
+        file.seek(0);
+        fileBytes = file.readAll();
+        fileData = (const uchar *)fileBytes.constData();
+    }
+
+    buildVoxelRemap();
+    std::vector<char> ok(voxelChunks.size());
+    parallelFor(voxelChunks.size(), MIN_THREAD_MODELS, [&](int i) {
+        const VoxelChunk &chunk = voxelChunks[i];
+        const VoxModel &model = pack.models[chunk.model];
+        ok[i] = true;
+        if (model.block < 0)
+            return;  // not used by the scene
+        const uchar *voxel = fileData + chunk.offset;
+        for (int v = 0; v < chunk.numVoxels; v++, voxel += 4) {
+            int x = voxel[0], y = voxel[1], z = voxel[2];
+            if (x >= model.xDim || y >= model.yDim || z >= model.zDim) {
+                qWarning() << "Bad voxel position!" << x << y << z;
+                ok[i] = false;
+                return;
+            }
+            pack.voxel(model, x, y, z) = voxelRemap[voxel[3]];
+        }
+    });
+
+    if (fileBytes.isEmpty())
+        file.unmap((uchar *)fileData);
+
+    // a model ordered more than once fills every one of its blocks
+    int levelBytes = pack.blockSize * pack.blockSize * pack.blockSize * 2;
+    for (int i = 0; i < blockModels.size(); i++) {
+        if (blockModels[i] < 0)
+            continue;
+        int block = pack.models[blockModels[i]].block;
+        if (block != i) {
+            auto src = pack.blockData.begin() + (size_t)block * pack.blockTexels * 2;
+            std::copy(src, src + levelBytes,
+                      pack.blockData.begin() + (size_t)i * pack.blockTexels * 2);
+        }
+    }
+    return std::all_of(ok.begin(), ok.end(), [](char c) { return c; });
+}
+
 bool VoxLoader::readSIZE() {
     int32_t xDim, yDim, zDim;
     file.read((char *)&xDim, 4);
     file.read((char *)&yDim, 4);
     file.read((char *)&zDim, 4);
     qDebug() << "Size:" << xDim << yDim << zDim;
+    if (xDim <= 0 || yDim <= 0 || zDim <= 0) {
+        qWarning() << "Bad model size!";
+        return false;
+    }
     pack.models.emplace_back(xDim, yDim, zDim);
     return true;
 }
 
-bool VoxLoader::readXYZI() {
+bool VoxLoader::readXYZI(int contentBytes) {
     int32_t numVoxels;
     file.read((char *)&numVoxels, 4);
     qDebug() << "Num voxels:" << numVoxels;
-    VoxModel &model = pack.models.back();
-    for (int i = 0; i < numVoxels; i++) {
-        uint8_t x, y, z, index;
-        file.read((char *)&x, 1);
-        file.read((char *)&y, 1);
-        file.read((char *)&z, 1);
-        file.read((char *)&index, 1);
-        if (x < 0 || x >= model.xDim
-                || y < 0 || y >= model.yDim
-                || z < 0 || z >= model.zDim) {
-            qWarning() << "Bad voxel position!" << x << y << z;
-            return false;
-        }
-        model.data[x + y * model.xDim + z * model.xDim * model.yDim] = index;
+    // voxels are decoded later straight from the file, which must hold them
+    if (pack.models.empty() || numVoxels < 0 || numVoxels > (contentBytes - 4) / 4
+            || file.pos() + 4 * (qint64)numVoxels > file.size()) {
+        qWarning() << "Bad XYZI chunk!";
+        return false;
     }
+    // belongs to the last SIZE chunk
+    voxelChunks.push_back(VoxelChunk{(int)pack.models.size() - 1, file.pos(), numVoxels});
     return true;
 }
 
@@ -134,7 +458,7 @@ bool VoxLoader::readRGBA() {
 }
 
 bool VoxLoader::readnTRN() {
-    int32_t nodeID, childID;
+    int32_t nodeID, childID, reservedID, layerID, numFrames;
     std::string name;
     file.read((char *)&nodeID, 4);
     auto nodeAttr = readDICT();
@@ -142,8 +466,46 @@ bool VoxLoader::readnTRN() {
         name = nodeAttr["_name"];
     }
     file.read((char *)&childID, 4);
+    file.read((char *)&reservedID, 4);
+    file.read((char *)&layerID, 4);
+    file.read((char *)&numFrames, 4);
+
+    transformNodes[nodeID] = transforms.size();
     transforms.emplace_back(name, nodeID, childID);
-    // ignore the rest
+    VoxTransform &t = transforms.back();
+    t.hidden = nodeAttr.count("_hidden") && nodeAttr["_hidden"] == "1";
+
+    for (int i = 0; i < numFrames; i++) {
+        auto frameAttr = readDICT();
+        if (i != 0)
+            continue;  // animation frames are ignored
+        if (frameAttr.count("_r")) {
+            try {
+                t.rotation = decodeRotation(std::stoi(frameAttr["_r"]));
+            }  catch (const std::logic_error &e) {
+                qWarning() << "Invalid rotation" << QString::fromStdString(frameAttr["_r"]);
+            }
+        }
+        if (frameAttr.count("_t")) {
+            glm::ivec3 &v = t.translation;
+            if (std::sscanf(frameAttr["_t"].c_str(), "%d %d %d", &v.x, &v.y, &v.z) != 3)
+                qWarning() << "Invalid translation" << QString::fromStdString(frameAttr["_t"]);
+        }
+    }
+    return true;
+}
+
+bool VoxLoader::readnGRP() {
+    int32_t nodeID, numChildren;
+    file.read((char *)&nodeID, 4);
+    readDICT();
+    file.read((char *)&numChildren, 4);
+    std::vector<int> &children = groupNodeChildren[nodeID];
+    for (int i = 0; i < numChildren; i++) {
+        int32_t childID;
+        file.read((char *)&childID, 4);
+        children.push_back(childID);
+    }
     return true;
 }
 
@@ -183,3 +545,30 @@ std::string VoxLoader::readSTRING() {
     delete[] buffer;
     return s;
 }
+
+glm::mat3 decodeRotation(int r)
+{
+    // bits 0-1 and 2-3 are the column of the nonzero entry in rows 0 and 1,
+    // bits 4-6 are the signs of rows 0-2
+    int col0 = r & 3, col1 = (r >> 2) & 3;
+    int col2 = 3 - col0 - col1;
+    if (col0 > 2 || col1 > 2 || col0 == col1) {
+        qWarning() << "Invalid rotation" << r;
+        return glm::mat3(1);
+    }
+    glm::mat3 m(0);
+    m[col0][0] = (r & 16) ? -1 : 1;
+    m[col1][1] = (r & 32) ? -1 : 1;
+    m[col2][2] = (r & 64) ? -1 : 1;
+    return m;
+}
+
+// blocks are cubes with power of two size, at least blockSize. anything
+// over MAX_BLOCK_SIZE is too big
+int fitBlockSize(const VoxModel &model, int blockSize)
+{
+    int maxDim = glm::max(model.xDim, glm::max(model.yDim, model.zDim));
+    while (blockSize < maxDim && blockSize <= MAX_BLOCK_SIZE)
+        blockSize *= 2;
+    return blockSize;
+}
@@ -5,26 +5,91 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <glm/glm.hpp>
 #include "util.h"
 
 static const int PALETTE_ENTRIES = 256;
 static const int PALETTE_SIZE = PALETTE_ENTRIES * 4;
 
-struct VoxModel : noncopyable
+// these must match the shader
+
+// enough for 256^3 blocks
+static const int MAX_MIP_LEVELS = 9;
+static const int MAX_BLOCK_SIZE = 1 << (MAX_MIP_LEVELS - 1);
+// the shader packs a texel offset into an int with 3 bits to spare
+static const int MAX_MODEL_TEXELS = 1 << 28;
+// voxel values, from INDEX_INSTANCE up they are nested blocks
+static const int INDEX_AIR = 0;
+static const int INDEX_SKY = 127;
+static const int INDEX_INSTANCE = 128;
+// nested blocks this deep are solid
+static const int MAX_RECURSE_DEPTH = 4;
+static const float EPSILON = 0.0001f;
+static const float DRAW_DIST = 256;
+
+// byte index of a voxel value in a cube of size dim, the distance is at +1
+#define UDF_INDEX(x, y, z, dim) (((x) + (dim)*(y) + (dim)*(dim)*(z)) * 2)
+
+// Each block is stored as a chain of mip levels, full size first, each half
+// the size of the previous one down to a single voxel. Every voxel is two
+// bytes: the value and the distance field.
+int BlockMipLevels(int blockSize);
+// texel offset of a mip level within a block, level == BlockMipLevels()
+// gives the texel size of the whole block
+int BlockMipOffset(int blockSize, int level);
+
+// voxels are stored in level 0 of the model's block in VoxPack::blockData
+struct VoxModel
 {
     VoxModel(int xDim, int yDim, int zDim)
-        : xDim(xDim), yDim(yDim), zDim(zDim)
-        , data(xDim * yDim * zDim) { }
+        : xDim(xDim), yDim(yDim), zDim(zDim) { }
 
     int xDim, yDim, zDim;
-    std::vector<char> data;
+    int block = -1;  // -1 if the model isn't used, and has no voxels
+};
+
+// a model placed in the world by the scene graph
+struct VoxInstance
+{
+    int model;  // index in VoxPack::models
+    glm::mat3 rotation;  // signed permutation, always axis aligned
+    glm::ivec3 origin;  // world position of the model's (0,0,0) corner
+    glm::ivec3 boundsMin, boundsMax;  // world space
 };
 
+// Models are stored in one arena, already in the layout uploaded to the GPU,
+// so they can be preprocessed in place. Move only.
 struct VoxPack : noncopyable
 {
+    VoxPack() = default;
+    VoxPack(VoxPack &&) = default;
+    VoxPack &operator=(VoxPack &&) = default;
+
+    // size blocks to fit every model with a block and allocate them as air,
+    // blocks are at least minBlockSize. false if they won't fit on the GPU
+    bool allocateBlocks(int numBlocks, int minBlockSize);
+    unsigned char &voxel(const VoxModel &model, int x, int y, int z)
+    {
+        return blockData[(size_t)model.block * blockTexels * 2
+                + UDF_INDEX(x, y, z, blockSize)];
+    }
+    // record the memory held in the stats registry, if it has a name
+    void accountMemory(bool held) const;
+
+    QString name;  // for stats, the file it was loaded from
     std::vector<VoxModel> models;
-    std::vector<VoxModel *> orderedModels;
+    std::vector<int> orderedModels;  // index in models, -1 for an empty block
+    std::vector<VoxInstance> instances;
     float palette[PALETTE_SIZE];
+
+    // ordered models are the first blocks in order, followed by any other
+    // instanced models. instanced models can't be bigger than the ordered
+    // blocks. in every model, palette indices from 128 up are the ordered
+    // block at index - 128. other indices from 128 are replaced by the
+    // closest color below, see VoxLoader::buildVoxelRemap()
+    int blockSize = 0;
+    int blockTexels = 0;  // per block, including all mip levels
+    std::vector<unsigned char> blockData;
 };
 
 struct VoxTransform : noncopyable
@@ -33,32 +98,73 @@ struct VoxTransform : noncopyable
         : name(name), id(id), child(child) { }
     std::string name;
     int id, child;
+    bool hidden = false;
+    int order = -1;  // block order from the name, or -1 if not a block
+    glm::mat3 rotation = glm::mat3(1);
+    glm::ivec3 translation = glm::ivec3(0);
 };
 
 class VoxLoader : noncopyable
 {
 public:
-    VoxLoader(QString filename);
+    // blocks are at least minBlockSize
+    VoxLoader(QString filename, int minBlockSize = 8);
+    ~VoxLoader();
 
     bool load();
 
     VoxPack pack;
 
 private:
+    bool readFile();
+    // older format, a single volume with a palette
+    bool readXRAW();
     bool readChunk();
     // chunk types
     bool readSIZE();
-    bool readXYZI();
+    // only records where the voxels are, see decodeVoxels()
+    bool readXYZI(int contentBytes);
     bool readRGBA();
     bool readnTRN();
+    bool readnGRP();
     bool readnSHP();
     // data types
     std::unordered_map<std::string, std::string> readDICT();
     std::string readSTRING();
 
+    // give ordered and instanced models a block and allocate them
+    bool allocateBlocks();
+    // fill in every used model from its XYZI chunk, in parallel
+    bool decodeVoxels();
+    // palette index to voxel value, after ordered models and the palette
+    void buildVoxelRemap();
+
+    // walk the scene graph and add an instance for every visible shape
+    void flattenNode(int nodeID, const glm::mat3 &rotation,
+                     glm::ivec3 translation, int depth);
+    void addInstance(int modelID, const glm::mat3 &rotation,
+                     glm::ivec3 translation);
+
     QFile file;
+    int minBlockSize;
+    // model in each block, a model ordered twice is copied to the second one
+    std::vector<int> blockModels;
+    uchar voxelRemap[PALETTE_ENTRIES];
+
+    // an XYZI chunk found by the index pass
+    struct VoxelChunk
+    {
+        int model;
+        qint64 offset;  // of the first voxel in the file
+        int numVoxels;
+    };
+    std::vector<VoxelChunk> voxelChunks;
 
     std::vector<VoxTransform> transforms;
+    // maps transform node ID to index in transforms
+    std::unordered_map<int, int> transformNodes;
+    // maps group node ID to child node IDs
+    std::unordered_map<int, std::vector<int>> groupNodeChildren;
     // maps shape node ID to model ID
     std::unordered_map<int, int> shapeNodeModels;
 };
@@ -0,0 +1,148 @@
+#include "voxpreprocess.h"
+#include <glm/glm.hpp>
+#include "stats.h"
+
+void BuildVoxWorld(VoxPack &pack, VoxWorld &world)
+{
+    world.name = pack.name;
+    world.blockSize = pack.blockSize;
+    world.blockTexels = pack.blockTexels;
+    world.udfVoxData = std::move(pack.blockData);
+    pack.blockData.clear();
+    pack.accountMemory(true);
+
+    // blocks are independent
+    int numBlocks = world.blockTexels ? world.udfVoxData.size() / (world.blockTexels * 2) : 0;
+    {
+        ScopedTimer timer("udf build");
+        parallelFor(numBlocks, 1, [&](int blockI) {
+            PreprocessBlock(world.udfVoxData.data() + (size_t)blockI * world.blockTexels * 2,
+                            world.blockSize);
+        });
+    }
+
+    world.instances.clear();
+    for (auto &instance : pack.instances) {
+        const VoxModel &model = pack.models[instance.model];
+        world.instances.push_back(BlockInstance{
+            model.block, instance.rotation, instance.origin,
+            glm::ivec3(model.xDim, model.yDim, model.zDim)});
+    }
+    world.bvh = buildSceneBVH(pack.instances);
+    world.accountMemory(true);
+}
+
+VoxWorld::~VoxWorld()
+{
+    accountMemory(false);
+}
+
+void VoxWorld::accountMemory(bool held)
+{
+    if (name.isEmpty())
+        return;
+    auto &stats = StatsRegistry::instance();
+    QString key = "VoxWorld " + name;
+    stats.setBytes("cpu", key + " udfVoxData", held ? udfVoxData.capacity() : 0);
+    stats.setBytes("cpu", key + " instances", held
+                   ? instances.capacity() * sizeof(BlockInstance)
+                     + bvh.capacity() * sizeof(BVHNode)
+                   : 0);
+}
+
+void PreprocessBlock(unsigned char *udfVoxData, int blockSize)
+{
+    BuildDistanceField(udfVoxData, blockSize, 0);
+    int levels = BlockMipLevels(blockSize);
+    for (int level = 1; level < levels; level++) {
+        int srcOffset = BlockMipOffset(blockSize, level - 1) * 2;
+        int offset = BlockMipOffset(blockSize, level) * 2;
+        BuildMip(udfVoxData, blockSize >> level, srcOffset, offset);
+        BuildDistanceField(udfVoxData, blockSize >> level, offset);
+    }
+}
+
+bool IsFilled(unsigned char *udfVoxData, int dim, int offset,
+              int cx, int cy, int cz, int size, int value)
+{
+    int minX = cx - size, minY = cy - size, minZ = cz - size;
+    int maxX = cx + size, maxY = cy + size, maxZ = cz + size;
+    for (int z = minZ; z <= maxZ; z++) {
+        for (int y = minY; y <= maxY; y++) {
+            for (int x = minX; x <= maxX; x++) {
+                if (glm::length(glm::vec3( glm::max(glm::abs(x - cx) - 1, 0),
+                                           glm::max(glm::abs(y - cy) - 1, 0),
+                                           glm::max(glm::abs(z - cz) - 1, 0) ))
+                        >= size + 0.01)
+                    continue;
+                int index = UDF_INDEX((x + dim) % dim, (y + dim) % dim,
+                                      (z + dim) % dim, dim) + offset;
+                if (udfVoxData[index] != value)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+void BuildDistanceField(unsigned char *udfVoxData, int dim, int offset)
+{
+    // very slow brute force!!
+    for (int z = 0; z < dim; z++) {
+        for (int y = 0; y < dim; y++) {
+            for (int x = 0; x < dim; x++) {
+                int index = UDF_INDEX(x, y, z, dim) + offset;
+                int value = udfVoxData[index];
+                int size;
+                for (size = 1; size < dim; size++) {
+                    if (!IsFilled(udfVoxData, dim, offset,
+                                  x, y, z, size, value)) {
+                        break;
+                    }
+                }
+                size--;
+                udfVoxData[index + 1] = size;
+            }
+        }
+    }
+}
+
+// fill a block of size dim from the block of size dim*2 at srcOffset
+// a voxel is solid if at least half of its children are, and takes the
+// most common solid value
+void BuildMip(unsigned char *udfVoxData, int dim, int srcOffset, int offset)
+{
+    for (int z = 0; z < dim; z++) {
+        for (int y = 0; y < dim; y++) {
+            for (int x = 0; x < dim; x++) {
+                int values[8], counts[8];
+                int numValues = 0, numSolid = 0;
+                for (int i = 0; i < 8; i++) {
+                    int value = udfVoxData[UDF_INDEX(x * 2 + (i & 1), y * 2 + ((i >> 1) & 1),
+                                                     z * 2 + (i >> 2), dim * 2) + srcOffset];
+                    if (value == 0)
+                        continue;  // air
+                    numSolid++;
+                    int j;
+                    for (j = 0; j < numValues && values[j] != value; j++);
+                    if (j == numValues) {
+                        values[numValues] = value;
+                        counts[numValues++] = 0;
+                    }
+                    counts[j]++;
+                }
+                int best = 0;
+                if (numSolid >= 4) {
+                    int bestCount = 0;
+                    for (int j = 0; j < numValues; j++) {
+                        if (counts[j] > bestCount) {
+                            best = values[j];
+                            bestCount = counts[j];
+                        }
+                    }
+                }
+                udfVoxData[UDF_INDEX(x, y, z, dim) + offset] = best;
+            }
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef VOXPREPROCESS_H
+#define VOXPREPROCESS_H
+
+#include <vector>
+#include "voxloader.h"
+#include "scenebvh.h"
+
+// a scene instance resolved to the block holding its model
+struct BlockInstance
+{
+    int block;
+    glm::mat3 rotation;
+    glm::ivec3 origin, size;
+};
+
+// everything the renderer needs from a pack, independent of OpenGL
+struct VoxWorld : noncopyable
+{
+    ~VoxWorld();
+    // record the memory held in the stats registry, if it has a name
+    void accountMemory(bool held);
+
+    QString name;  // for stats, taken from the pack
+    int blockSize = 0;
+    int blockTexels = 0;  // per block, including all mip levels
+    // distance field stores the minimum distance from the *edge* of this voxel
+    // to the *edge* of a voxel of a different value.
+    // kept after upload for CPU queries
+    std::vector<unsigned char> udfVoxData;
+    // if there are no instances, block 0 is the world, repeating forever
+    std::vector<BlockInstance> instances;
+    std::vector<BVHNode> bvh;  // over instances
+};
+
+// takes the blocks from the pack and preprocesses them in place, the pack
+// keeps everything else
+void BuildVoxWorld(VoxPack &pack, VoxWorld &world);
+
+// build the distance field for level 0, then every other mip level
+void PreprocessBlock(unsigned char *udfVoxData, int blockSize);
+
+bool IsFilled(unsigned char *udfVoxData, int dim, int offset,
+              int cx, int cy, int cz, int size, int value);
+void BuildDistanceField(unsigned char *udfVoxData, int dim, int offset);
+void BuildMip(unsigned char *udfVoxData, int dim, int srcOffset, int offset);
+
+#endif // VOXPREPROCESS_H
@@ -0,0 +1,308 @@
+#include "voxquery.h"
+#include <algorithm>
+#include <limits>
+
+static const int MAX_STEPS = 4096;
+// smallest batch worth starting a thread for
+static const int MIN_THREAD_QUERIES = 256;
+
+// returns entry and exit distance, entry > exit if missed
+static glm::vec2 intersectBox(glm::vec3 origin, glm::vec3 invDir,
+                              glm::vec3 boxMin, glm::vec3 boxMax,
+                              glm::vec3 &normal)
+{
+    glm::vec3 t0 = (boxMin - origin) * invDir;
+    glm::vec3 t1 = (boxMax - origin) * invDir;
+    glm::vec3 tMin = glm::min(t0, t1);
+    glm::vec3 tMax = glm::max(t0, t1);
+    float near = glm::max(tMin.x, glm::max(tMin.y, tMin.z));
+    float far = glm::min(tMax.x, glm::min(tMax.y, tMax.z));
+    for (int axis = 0; axis < 3; axis++)
+        normal[axis] = tMin[axis] == near ? (invDir[axis] > 0 ? -1.0f : 1.0f) : 0.0f;
+    return glm::vec2(near, far);
+}
+
+namespace {
+
+struct Sphere
+{
+    glm::vec3 center;
+    float radius;
+
+    glm::vec3 boundsMin() const { return center - radius; }
+    glm::vec3 boundsMax() const { return center + radius; }
+    bool overlapsBox(glm::vec3 boxMin, glm::vec3 boxMax) const
+    {
+        glm::vec3 closest = glm::clamp(center, boxMin, boxMax);
+        glm::vec3 d = center - closest;
+        return glm::dot(d, d) < radius * radius;
+    }
+    Sphere toChild(glm::ivec3 cell, int blockSize) const
+    {
+        return Sphere{(center - glm::vec3(cell)) * (float)blockSize, radius * blockSize};
+    }
+    Sphere toLocal(const BlockInstance &instance) const
+    {
+        return Sphere{glm::transpose(instance.rotation)
+                      * (center - glm::vec3(instance.origin)), radius};
+    }
+};
+
+struct Box
+{
+    glm::vec3 min, max;
+
+    glm::vec3 boundsMin() const { return min; }
+    glm::vec3 boundsMax() const { return max; }
+    bool overlapsBox(glm::vec3 boxMin, glm::vec3 boxMax) const
+    {
+        return min.x < boxMax.x && min.y < boxMax.y && min.z < boxMax.z
+                && max.x > boxMin.x && max.y > boxMin.y && max.z > boxMin.z;
+    }
+    Box toChild(glm::ivec3 cell, int blockSize) const
+    {
+        return Box{(min - glm::vec3(cell)) * (float)blockSize,
+                   (max - glm::vec3(cell)) * (float)blockSize};
+    }
+    Box toLocal(const BlockInstance &instance) const
+    {
+        // rotation is axis aligned so the box stays a box
+        glm::mat3 invRotation = glm::transpose(instance.rotation);
+        glm::vec3 a = invRotation * (min - glm::vec3(instance.origin));
+        glm::vec3 b = invRotation * (max - glm::vec3(instance.origin));
+        return Box{glm::min(a, b), glm::max(a, b)};
+    }
+};
+
+}
+
+VoxQuery::VoxQuery(const VoxWorld &world)
+    : world(world)
+{ }
+
+RayHit VoxQuery::castRay(const RayQuery &ray) const
+{
+    RayHit hit;
+    hit.dist = 0;
+    if (world.udfVoxData.empty()) {
+        hit.value = INDEX_AIR;
+        hit.dist = ray.maxDist;
+        hit.normal = -ray.dir;
+    } else if (world.instances.empty()) {
+        hit.value = raymarch(ray.origin, ray.dir, 0, ray.maxDist, hit.dist, hit.normal);
+    } else {
+        hit.value = traceScene(ray.origin, ray.dir, ray.maxDist, hit.dist, hit.normal);
+    }
+    hit.hit = hit.value != INDEX_AIR;
+    // step back through the surface into the voxel that was hit
+    hit.voxel = glm::ivec3(glm::floor(ray.origin + ray.dir * hit.dist - hit.normal * 0.001f));
+    return hit;
+}
+
+bool VoxQuery::overlapSphere(const SphereQuery &sphere) const
+{
+    return overlap(Sphere{sphere.center, sphere.radius});
+}
+
+bool VoxQuery::overlapBox(const BoxQuery &box) const
+{
+    return overlap(Box{box.boundsMin, box.boundsMax});
+}
+
+std::vector<RayHit> VoxQuery::castRays(const std::vector<RayQuery> &rays) const
+{
+    std::vector<RayHit> hits(rays.size());
+    parallelFor(rays.size(), MIN_THREAD_QUERIES, [&](int i) {
+        hits[i] = castRay(rays[i]);
+    });
+    return hits;
+}
+
+std::vector<char> VoxQuery::overlapSpheres(const std::vector<SphereQuery> &spheres) const
+{
+    std::vector<char> results(spheres.size());
+    parallelFor(spheres.size(), MIN_THREAD_QUERIES, [&](int i) {
+        results[i] = overlapSphere(spheres[i]);
+    });
+    return results;
+}
+
+std::vector<char> VoxQuery::overlapBoxes(const std::vector<BoxQuery> &boxes) const
+{
+    std::vector<char> results(boxes.size());
+    parallelFor(boxes.size(), MIN_THREAD_QUERIES, [&](int i) {
+        results[i] = overlapBox(boxes[i]);
+    });
+    return results;
+}
+
+// same as raymarch() in the shader, without level of detail
+int VoxQuery::raymarch(glm::vec3 origin, glm::vec3 dir, int block,
+                       float maxDist, float &dist, glm::vec3 &normal) const
+{
+    int blockSize = world.blockSize;
+    normal = -dir;
+    float scale = 1;
+    int blockOffset = block * world.blockTexels;
+    int recurse = 0;
+    float maxDistStack[MAX_RECURSE_DEPTH];
+    int blockOffsetStack[MAX_RECURSE_DEPTH];
+    glm::vec3 normalStack[MAX_RECURSE_DEPTH];
+    for (int i = 0; i < MAX_STEPS; i++) {
+        glm::vec3 p = (origin + dir * dist) * scale;
+        glm::ivec3 voxelCoord = glm::ivec3(glm::floor(p)) & (blockSize - 1);
+        int texelIndex = blockOffset + voxelCoord.x
+                + (voxelCoord.y + voxelCoord.z * blockSize) * blockSize;
+        int value = world.udfVoxData[texelIndex * 2];
+        int skip = world.udfVoxData[texelIndex * 2 + 1];
+        // too deeply nested instances count as solid
+        bool descend = value >= INDEX_INSTANCE && recurse < MAX_RECURSE_DEPTH;
+        if (value != INDEX_AIR && !descend)
+            return value;
+
+        glm::vec3 deltas;
+        for (int axis = 0; axis < 3; axis++) {
+            if (glm::abs(dir[axis]) < EPSILON)
+                deltas[axis] = std::numeric_limits<float>::max();
+            else
+                deltas[axis] = ((dir[axis] >= 0 ? 1 : 0) - glm::fract(p[axis])) / dir[axis] / scale;
+        }
+        float minDelta = glm::min(deltas.x, glm::min(deltas.y, deltas.z));
+        float nextDist = dist + glm::max(minDelta + skip / scale, EPSILON);
+        glm::vec3 stepNormal;
+        for (int axis = 0; axis < 3; axis++)
+            stepNormal[axis] = deltas[axis] == minDelta ? -glm::sign(dir[axis]) : 0;
+        if (descend) {
+            maxDistStack[recurse] = maxDist;
+            blockOffsetStack[recurse] = blockOffset;
+            normalStack[recurse] = stepNormal;
+            recurse++;
+            scale *= blockSize;
+            maxDist = nextDist;
+            blockOffset = (value - INDEX_INSTANCE) * world.blockTexels;
+        } else {
+            dist = nextDist;
+            while (dist >= maxDist - EPSILON) {
+                if (recurse == 0) {
+                    dist = maxDist;
+                    normal = -dir;
+                    return INDEX_AIR;
+                }
+                recurse--;
+                dist = maxDist + EPSILON;
+                maxDist = maxDistStack[recurse];
+                blockOffset = blockOffsetStack[recurse];
+                stepNormal = normalStack[recurse];
+                scale /= blockSize;
+            }
+            normal = stepNormal;
+        }
+    }
+    // gave up, count as a miss
+    dist = maxDist;
+    normal = -dir;
+    return INDEX_AIR;
+}
+
+// same as traceScene() in the shader
+int VoxQuery::traceScene(glm::vec3 origin, glm::vec3 dir,
+                         float maxDist, float &dist, glm::vec3 &normal) const
+{
+    normal = -dir;
+    glm::vec3 invDir;
+    for (int axis = 0; axis < 3; axis++)
+        invDir[axis] = 1 / (glm::abs(dir[axis]) < EPSILON ? EPSILON : dir[axis]);
+    int hitValue = INDEX_AIR;
+    float hitDist = maxDist;
+    int node = 0;
+    while (node < world.bvh.size()) {
+        const BVHNode &n = world.bvh[node];
+        glm::vec3 entryNormal;
+        glm::vec2 t = intersectBox(origin, invDir, glm::vec3(n.boundsMin),
+                                   glm::vec3(n.boundsMax), entryNormal);
+        if (t.x > t.y || t.y < dist || t.x > hitDist) {
+            node = n.skip;
+            continue;
+        }
+        node++;
+        if (n.instance < 0)
+            continue;
+
+        const BlockInstance &instance = world.instances[n.instance];
+        glm::mat3 invRotation = glm::transpose(instance.rotation);
+        glm::vec3 localOrigin = invRotation * (origin - glm::vec3(instance.origin));
+        glm::vec3 localDir = invRotation * dir;
+        float startDist = glm::max(t.x + EPSILON, dist);
+        float localDist = startDist;
+        glm::vec3 localNormal;
+        int value = raymarch(localOrigin, localDir, instance.block,
+                             glm::min(t.y, hitDist), localDist, localNormal);
+        if (value != INDEX_AIR && localDist < hitDist) {
+            hitValue = value;
+            hitDist = localDist;
+            normal = localDist == startDist && startDist > dist ?
+                        entryNormal : instance.rotation * localNormal;
+        }
+    }
+    dist = hitDist;
+    return hitValue;
+}
+
+template<typename Shape>
+bool VoxQuery::overlap(const Shape &shape) const
+{
+    if (world.udfVoxData.empty())
+        return false;
+    if (world.instances.empty())
+        return overlapBlock(0, shape, 0, true);
+
+    int node = 0;
+    while (node < world.bvh.size()) {
+        const BVHNode &n = world.bvh[node];
+        if (!shape.overlapsBox(glm::vec3(n.boundsMin), glm::vec3(n.boundsMax))) {
+            node = n.skip;
+            continue;
+        }
+        node++;
+        if (n.instance >= 0) {
+            const BlockInstance &instance = world.instances[n.instance];
+            if (overlapBlock(instance.block, shape.toLocal(instance), 0, false))
+                return true;
+        }
+    }
+    return false;
+}
+
+template<typename Shape>
+bool VoxQuery::overlapBlock(int block, const Shape &shape, int depth, bool wrap) const
+{
+    int blockSize = world.blockSize;
+    glm::ivec3 lo = glm::ivec3(glm::floor(shape.boundsMin()));
+    glm::ivec3 hi = glm::ivec3(glm::floor(shape.boundsMax()));
+    if (!wrap) {
+        lo = glm::max(lo, glm::ivec3(0));
+        hi = glm::min(hi, glm::ivec3(blockSize - 1));
+    }
+    for (int z = lo.z; z <= hi.z; z++) {
+        for (int y = lo.y; y <= hi.y; y++) {
+            for (int x = lo.x; x <= hi.x; x++) {
+                glm::ivec3 cell(x, y, z);
+                if (!shape.overlapsBox(glm::vec3(cell), glm::vec3(cell + 1)))
+                    continue;
+                glm::ivec3 voxelCoord = cell & (blockSize - 1);
+                int texelIndex = block * world.blockTexels + voxelCoord.x
+                        + (voxelCoord.y + voxelCoord.z * blockSize) * blockSize;
+                int value = world.udfVoxData[texelIndex * 2];
+                if (value == INDEX_AIR)
+                    continue;
+                // too deeply nested instances count as solid, like in raymarch()
+                if (value < INDEX_INSTANCE || depth >= MAX_RECURSE_DEPTH)
+                    return true;
+                if (overlapBlock(value - INDEX_INSTANCE, shape.toChild(cell, blockSize),
+                                 depth + 1, false))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#ifndef VOXQUERY_H
+#define VOXQUERY_H
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "util.h"
+#include "voxpreprocess.h"
+
+struct RayQuery
+{
+    glm::vec3 origin;
+    glm::vec3 dir;  // normalized
+    float maxDist;
+};
+
+struct RayHit
+{
+    bool hit;
+    int value;  // palette index of the voxel that was hit
+    glm::ivec3 voxel;  // world voxel containing the hit point
+    glm::vec3 normal;
+    float dist;  // maxDist if nothing was hit
+};
+
+struct SphereQuery
+{
+    glm::vec3 center;
+    float radius;
+};
+
+struct BoxQuery
+{
+    glm::vec3 boundsMin, boundsMax;
+};
+
+// Ray casts and overlap tests against the same voxel data the shader uses,
+// always at full resolution. All methods are const and safe to call from
+// any thread, the batch versions split the queries across threads.
+class VoxQuery : noncopyable
+{
+public:
+    VoxQuery(const VoxWorld &world);
+
+    RayHit castRay(const RayQuery &ray) const;
+    bool overlapSphere(const SphereQuery &sphere) const;
+    bool overlapBox(const BoxQuery &box) const;
+
+    std::vector<RayHit> castRays(const std::vector<RayQuery> &rays) const;
+    // 1 for each query that overlaps a solid voxel
+    std::vector<char> overlapSpheres(const std::vector<SphereQuery> &spheres) const;
+    std::vector<char> overlapBoxes(const std::vector<BoxQuery> &boxes) const;
+
+private:
+    int raymarch(glm::vec3 origin, glm::vec3 dir, int block,
+                 float maxDist, float &dist, glm::vec3 &normal) const;
+    int traceScene(glm::vec3 origin, glm::vec3 dir,
+                   float maxDist, float &dist, glm::vec3 &normal) const;
+    template<typename Shape>
+    bool overlap(const Shape &shape) const;
+    // shape is in voxel coordinates of the block
+    template<typename Shape>
+    bool overlapBlock(int block, const Shape &shape, int depth, bool wrap) const;
+
+    const VoxWorld &world;
+};
+
+#endif // VOXQUERY_H
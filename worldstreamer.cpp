@@ -0,0 +1,287 @@
+#include "worldstreamer.h"
+#include "voxpreprocess.h"
+#include "stats.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QRegularExpression>
+#include <algorithm>
+#include <cmath>
+
+// chunks past the view distance that are loaded ahead of time, in chunks
+static const int PREFETCH_MARGIN = 2;
+
+WorldStreamer::WorldStreamer(QString dir, float viewDist)
+    : dir(dir), viewDist(viewDist)
+{ }
+
+WorldStreamer::~WorldStreamer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    requestCond.notify_one();
+    if (ioThread.joinable())
+        ioThread.join();
+}
+
+bool WorldStreamer::open()
+{
+    QDir qdir(dir);
+    QRegularExpression pattern("^(\\d+)_(\\d+)_(\\d+)\\.vox$");
+    int numChunks = 0;
+    QString firstFile;
+    for (const QString &name : qdir.entryList(QStringList() << "*.vox", QDir::Files)) {
+        auto match = pattern.match(name);
+        if (!match.hasMatch())
+            continue;
+        glm::ivec3 coord(match.captured(1).toInt(), match.captured(2).toInt(),
+                         match.captured(3).toInt());
+        gridDim = glm::max(gridDim, coord + 1);
+        numChunks++;
+        if (firstFile.isEmpty())
+            firstFile = qdir.filePath(name);
+    }
+    if (numChunks == 0) {
+        qWarning() << "No chunks in" << dir;
+        return false;
+    }
+    qDebug() << "Chunks:" << numChunks << "grid" << gridDim.x << gridDim.y << gridDim.z;
+
+    // every chunk is the same size and shares the palette of the first one
+    VoxLoader voxload(firstFile);
+    if (!voxload.load() || voxload.pack.models.empty())
+        return false;
+    const VoxModel &model = voxload.pack.models[0];
+    blockSize = model.xDim;
+    if (model.yDim != blockSize || model.zDim != blockSize
+            || blockSize < 8 || (blockSize & (blockSize - 1)) != 0) {
+        qWarning() << "Chunks must be cubes with power of two size, at least 8";
+        return false;
+    }
+    std::copy(voxload.pack.palette, voxload.pack.palette + PALETTE_SIZE, palette);
+
+    // everything update() might want, the window moves with the camera
+    windowRadius = (int)std::ceil(viewDist / blockSize) + PREFETCH_MARGIN;
+    windowDim = windowRadius * 2 + 1;
+    windowSlots.assign(windowDim * windowDim * windowDim, -1);
+    return true;
+}
+
+void WorldStreamer::start(int numSlots)
+{
+    this->numSlots = numSlots;
+    for (int i = numSlots - 1; i >= 0; i--)
+        freeSlots.push_back(i);
+    ioThread = std::thread(&WorldStreamer::ioThreadMain, this);
+}
+
+long long WorldStreamer::chunkKey(glm::ivec3 coord) const
+{
+    return coord.x + gridDim.x * (coord.y + (long long)gridDim.y * coord.z);
+}
+
+glm::ivec3 WorldStreamer::chunkCoord(long long key) const
+{
+    return glm::ivec3(key % gridDim.x, key / gridDim.x % gridDim.y,
+                      key / ((long long)gridDim.x * gridDim.y));
+}
+
+int WorldStreamer::windowIndex(glm::ivec3 coord) const
+{
+    glm::ivec3 rel = coord - windowMin;
+    if (rel.x < 0 || rel.y < 0 || rel.z < 0
+            || rel.x >= windowDim || rel.y >= windowDim || rel.z >= windowDim)
+        return -1;
+    glm::ivec3 wrapped = coord % windowDim;  // coords are never negative
+    return wrapped.x + (wrapped.y + wrapped.z * windowDim) * windowDim;
+}
+
+QString WorldStreamer::chunkPath(long long key) const
+{
+    glm::ivec3 coord = chunkCoord(key);
+    return QDir(dir).filePath(QString("%1_%2_%3.vox").arg(coord.x).arg(coord.y).arg(coord.z));
+}
+
+void WorldStreamer::update(glm::vec3 camPos)
+{
+    glm::vec3 camInChunks = camPos / (float)blockSize;
+    glm::ivec3 newCamChunk = glm::ivec3(glm::floor(camInChunks));
+    // nothing changes until the camera crosses into another chunk
+    if (hasCamChunk && newCamChunk == camChunk)
+        return;
+    hasCamChunk = true;
+    camChunk = newCamChunk;
+
+    // rewrite the window around the new camera chunk, chunks that left it
+    // are forgotten
+    windowMin = camChunk - windowRadius;
+    windowMoved = true;
+    std::fill(windowSlots.begin(), windowSlots.end(), -1);
+    for (auto &chunk : resident) {
+        int index = windowIndex(chunkCoord(chunk.first));
+        if (index >= 0)
+            windowSlots[index] = chunk.second.slot;
+    }
+    for (auto it = emptyChunks.begin(); it != emptyChunks.end(); ) {
+        if (windowIndex(chunkCoord(*it)) < 0)
+            it = emptyChunks.erase(it);
+        else
+            it++;
+    }
+
+    float viewRadius = viewDist / blockSize;
+    std::vector<std::pair<float, long long>> nearby;  // distance, key
+    glm::ivec3 lo = glm::max(camChunk - windowRadius, glm::ivec3(0));
+    glm::ivec3 hi = glm::min(camChunk + windowRadius, gridDim - 1);
+    for (int z = lo.z; z <= hi.z; z++) {
+        for (int y = lo.y; y <= hi.y; y++) {
+            for (int x = lo.x; x <= hi.x; x++) {
+                long long key = chunkKey(glm::ivec3(x, y, z));
+                if (emptyChunks.count(key))
+                    continue;
+                float dist = glm::length(glm::vec3(x, y, z) + 0.5f - camInChunks);
+                if (dist <= windowRadius)
+                    nearby.emplace_back(dist, key);
+            }
+        }
+    }
+    // never want more chunks than fit in the slots, so wanted chunks are
+    // never evicted by other wanted chunks
+    std::sort(nearby.begin(), nearby.end());
+    if (nearby.size() > numSlots)
+        nearby.resize(numSlots);
+
+    std::vector<long long> newRequests;
+    std::unordered_set<long long> newVisible;
+    wanted.clear();
+    // farthest first, so the nearest chunks end up most recently used and
+    // last in the requests
+    for (auto it = nearby.rbegin(); it != nearby.rend(); it++) {
+        long long key = it->second;
+        wanted.insert(key);
+        bool isResident = resident.count(key);
+        if (it->first <= viewRadius) {
+            newVisible.insert(key);
+            if (!visible.count(key)) {
+                if (isResident)
+                    stats.prefetchHits++;
+                else
+                    stats.prefetchMisses++;
+            }
+        }
+        if (isResident)
+            lru.splice(lru.begin(), lru, resident[key].lruPos);
+        else
+            newRequests.push_back(key);
+    }
+    visible.swap(newVisible);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.clear();
+        for (long long key : newRequests) {
+            if (!inFlight.count(key))
+                requests.push_back(key);
+        }
+    }
+    requestCond.notify_one();
+}
+
+std::vector<LoadedChunk> WorldStreamer::takeLoaded()
+{
+    std::vector<LoadedChunk> chunks;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks.swap(loaded);
+        for (auto &chunk : chunks)
+            inFlight.erase(chunk.key);
+    }
+    // drop chunks that are all air, or that the camera moved away from
+    chunks.erase(std::remove_if(chunks.begin(), chunks.end(), [this](const LoadedChunk &chunk) {
+        if (chunk.udfVoxData.empty() && windowIndex(chunkCoord(chunk.key)) >= 0)
+            emptyChunks.insert(chunk.key);
+        return chunk.udfVoxData.empty() || !wanted.count(chunk.key)
+                || resident.count(chunk.key);
+    }), chunks.end());
+    stats.loaded += chunks.size();
+    return chunks;
+}
+
+int WorldStreamer::allocateSlot(long long key, long long *evictedKey)
+{
+    *evictedKey = -1;
+    int slot;
+    if (!freeSlots.empty()) {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    } else {
+        long long oldKey = lru.back();
+        lru.pop_back();
+        slot = resident[oldKey].slot;
+        resident.erase(oldKey);
+        *evictedKey = oldKey;
+        stats.evicted++;
+        int oldIndex = windowIndex(chunkCoord(oldKey));
+        if (oldIndex >= 0)
+            windowSlots[oldIndex] = -1;
+    }
+    lru.push_front(key);
+    resident[key] = Resident{slot, lru.begin()};
+    int index = windowIndex(chunkCoord(key));
+    if (index >= 0)
+        windowSlots[index] = slot;
+    return slot;
+}
+
+void WorldStreamer::ioThreadMain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        requestCond.wait(lock, [this] { return stopping || !requests.empty(); });
+        if (stopping)
+            return;
+        LoadedChunk chunk;
+        chunk.key = requests.back();
+        requests.pop_back();
+        inFlight.insert(chunk.key);
+        lock.unlock();
+
+        loadChunk(chunk);
+
+        lock.lock();
+        loaded.push_back(std::move(chunk));
+    }
+}
+
+void WorldStreamer::loadChunk(LoadedChunk &chunk)
+{
+    // leaves udfVoxData empty if the chunk is all air or can't be loaded
+    QString path = chunkPath(chunk.key);
+    if (!QFile::exists(path))
+        return;  // nothing there, same as all air
+    VoxLoader voxload(path, blockSize);
+    if (!voxload.load() || voxload.pack.models.empty()) {
+        qWarning() << "Error loading chunk" << path;
+        return;
+    }
+    VoxPack &pack = voxload.pack;
+    if (pack.blockSize != blockSize || pack.models[0].block != 0) {
+        qWarning() << "Chunk too big or not a single model" << path;
+        return;
+    }
+    int levelBytes = blockSize * blockSize * blockSize * 2;
+    bool empty = true;
+    for (int i = 0; i < levelBytes && empty; i += 2)
+        empty = pack.blockData[i] == 0;
+    if (empty)
+        return;
+
+    // the block is already laid out, keep only the first one
+    pack.blockData.resize((size_t)pack.blockTexels * 2);
+    chunk.udfVoxData = std::move(pack.blockData);
+    ScopedTimer timer("chunk udf build");
+    PreprocessBlock(chunk.udfVoxData.data(), blockSize);
+}
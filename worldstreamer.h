@@ -0,0 +1,108 @@
+#ifndef WORLDSTREAMER_H
+#define WORLDSTREAMER_H
+
+#include <QString>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <glm/glm.hpp>
+#include "util.h"
+#include "voxloader.h"
+
+// a chunk loaded and preprocessed by the I/O thread, ready to upload
+struct LoadedChunk
+{
+    long long key;  // see chunkKey()
+    std::vector<unsigned char> udfVoxData;  // one block with all mip levels
+};
+
+struct StreamStats
+{
+    int loaded = 0, evicted = 0;
+    // chunks that came into view already resident, vs. not loaded yet
+    int prefetchHits = 0, prefetchMisses = 0;
+};
+
+// Pages a world stored as a directory of chunk files named "x_y_z.vox", each
+// holding one cubic model, into a fixed number of GPU block slots. Chunks
+// are requested nearest first around the camera and evicted least recently
+// used. Resident chunks are found through a window of slots around the
+// camera that wraps around as it moves, so memory doesn't depend on the
+// size of the world.
+class WorldStreamer : noncopyable
+{
+public:
+    WorldStreamer(QString dir, float viewDist);
+    ~WorldStreamer();
+
+    // find the extent of the world and read the block size and palette
+    bool open();
+    // start the I/O thread once the number of slots is known
+    void start(int numSlots);
+
+    // prioritize chunks around the camera, call every frame
+    void update(glm::vec3 camPos);
+    // chunks finished by the I/O thread since the last call that are still
+    // wanted, each must be given a slot with allocateSlot()
+    std::vector<LoadedChunk> takeLoaded();
+    // evictedKey is set to the chunk that lost the slot, or -1 if it was free
+    int allocateSlot(long long key, long long *evictedKey);
+
+    long long chunkKey(glm::ivec3 coord) const;
+    glm::ivec3 chunkCoord(long long key) const;
+    // index of a chunk in windowSlots, or -1 if it's outside the window
+    int windowIndex(glm::ivec3 coord) const;
+
+    int blockSize = 0;
+    int numSlots = 0;
+    glm::ivec3 gridDim = glm::ivec3(0);
+    float palette[PALETTE_SIZE];
+    StreamStats stats;
+
+    // slot of each chunk in the window, -1 if not resident. a chunk at coord
+    // is at coord % windowDim on each axis
+    int windowDim = 0;
+    glm::ivec3 windowMin = glm::ivec3(0);
+    std::vector<int> windowSlots;
+    bool windowMoved = false;  // every slot changed, cleared by the caller
+
+private:
+    void ioThreadMain();
+    void loadChunk(LoadedChunk &chunk);
+    QString chunkPath(long long key) const;
+
+    QString dir;
+    float viewDist;
+    int windowRadius = 0;  // in chunks, around the camera chunk
+    std::unordered_set<long long> emptyChunks;  // all air or missing, in the window
+    std::unordered_set<long long> wanted;  // nearest chunks, at most numSlots
+    std::unordered_set<long long> visible;  // wanted chunks within view distance
+
+    // resident chunks, most recently wanted first
+    struct Resident
+    {
+        int slot;
+        std::list<long long>::iterator lruPos;
+    };
+    std::list<long long> lru;
+    std::unordered_map<long long, Resident> resident;
+    std::vector<int> freeSlots;
+
+    bool hasCamChunk = false;
+    glm::ivec3 camChunk;
+
+    // shared with the I/O thread
+    std::thread ioThread;
+    std::mutex mutex;
+    std::condition_variable requestCond;
+    std::vector<long long> requests;  // highest priority last
+    std::unordered_set<long long> inFlight;  // taken by the I/O thread, not returned yet
+    std::vector<LoadedChunk> loaded;
+    bool stopping = false;
+};
+
+#endif // WORLDSTREAMER_H